@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <float.h>
 #include <math.h>
@@ -8,8 +9,97 @@
 // which should represent operators and "literals". The distinction is mostly
 // for organizational purposes.
 
+// Maximum number of iterations for the continued fraction in reg_inc_beta.
+// It converges in O(sqrt(max(a, b))) iterations, so this is plenty.
+#define BETA_CF_MAX_ITER 100000
+
+/**
+ * Evaluates the continued fraction for the regularized incomplete beta
+ * function, using the modified Lentz method (see Numerical Recipes, betacf).
+ *
+ * \param a First shape parameter
+ * \param b Second shape parameter
+ * \param x Point to evaluate at, should be < (a+1)/(a+b+2) for fast convergence
+ * \return Value of the continued fraction
+ */
+double beta_cf(const double a, const double b, const double x) {
+    const double tiny = 1e-300;
+    double c = 1.0;
+    double d = 1.0 - (a+b)*x/(a+1.0);
+    d = (fabs(d) < tiny) ? tiny : d;
+    d = 1.0/d;
+    double h = d;
+    for (int m = 1; m <= BETA_CF_MAX_ITER; m++) {
+        const int m2 = 2*m;
+        double aa = m*(b-m)*x/((a+m2-1.0)*(a+m2));
+        d = 1.0 + aa*d;
+        d = (fabs(d) < tiny) ? tiny : d;
+        c = 1.0 + aa/c;
+        c = (fabs(c) < tiny) ? tiny : c;
+        d = 1.0/d;
+        h *= d*c;
+        aa = -(a+m)*(a+b+m)*x/((a+m2)*(a+m2+1.0));
+        d = 1.0 + aa*d;
+        d = (fabs(d) < tiny) ? tiny : d;
+        c = 1.0 + aa/c;
+        c = (fabs(c) < tiny) ? tiny : c;
+        d = 1.0/d;
+        const double del = d*c;
+        h *= del;
+        if (fabs(del-1.0) < DBL_EPSILON) {
+            break;
+        }
+    }
+    return h;
+}
+
+/**
+ * Regularized incomplete beta function I_x(a, b) and its complement
+ * 1 - I_x(a, b) = I_y(b, a), where y = 1-x. Whichever of the two is smaller is
+ * computed directly, so neither loses precision in the tails. x and y are
+ * passed separately because the caller can usually compute y more precisely
+ * than 1-x.
+ *
+ * \param a First shape parameter
+ * \param b Second shape parameter
+ * \param lbeta log(Beta(a, b)), precomputed since it doesn't depend on x
+ * \param x Point to evaluate at
+ * \param y 1-x
+ * \param[out] lower Where I_x(a, b) is stored
+ * \param[out] upper Where 1 - I_x(a, b) is stored
+ */
+void reg_inc_beta(const double a, const double b, const double lbeta,
+                  const double x, const double y, double* lower, double* upper) {
+    if (x <= 0.0) {
+        *lower = 0.0;
+        *upper = 1.0;
+        return;
+    } else if (y <= 0.0) {
+        *lower = 1.0;
+        *upper = 0.0;
+        return;
+    }
+    const double front = exp(a*log(x) + b*log(y) - lbeta);
+    if (x < (a+1.0)/(a+b+2.0)) {
+        *lower = front*beta_cf(a, b, x)/a;
+        *upper = 1.0 - *lower;
+    } else {
+        *upper = front*beta_cf(b, a, y)/b;
+        *lower = 1.0 - *upper;
+    }
+}
+
+// Arrays shorter than this aren't worth splitting across threads.
+#define ORDER_STAT_PARALLEL_LEN 4096
+
 /**
  * Computes order statistic in-place.
+ *
+ * If F is the CDF of arr, the pos-th smallest of num samples is <= x exactly
+ * when at least pos of the samples are <= x, which is a binomial tail:
+ * I_F(x)(pos, num-pos+1), the regularized incomplete beta function. We
+ * evaluate that at every element (in parallel, since each one is
+ * independent) and take differences.
  * 
  * \param[in,out] arr: Input array, representing a PMF
  * \param len: length of arr
@@ -28,34 +118,67 @@ void arr_order_stat(double* arr, const int64_t len, const int64_t num, int64_t p
     if (num == 1 && pos == 1) {
         return;
     }
+    // cdf[i] = P(X <= i), sf[i] = P(X > i). We keep both, summed from
+    // opposite ends, so that small tail probabilities stay precise.
+    double* cdf = malloc(len*sizeof(double));
+    double* sf = malloc(len*sizeof(double));
     #if LDBL_MANT_DIG == 64
     long double cumulative = 0.0;
+    for (int64_t i = 0; i < len; i++) {
+        cumulative += arr[i];
+        cdf[i] = cumulative;
+    }
+    long double total = cumulative;
+    cumulative = 0.0;
+    for (int64_t i = len-1; i >= 0; i--) {
+        sf[i] = cumulative/total;
+        cumulative += arr[i];
+        cdf[i] /= total;
+    }
     #else
+    // Kahan summation
     double cumulative = 0.0;
     double comp = 0.0;
-    #endif
     for (int64_t i = 0; i < len; i++) {
-        #if LDBL_MANT_DIG == 64
-        cumulative += arr[i];
-        #else
-        // Kahan summation
         double y = arr[i] - comp;
         double t = cumulative + y;
         comp = (t - cumulative) - y;
         cumulative = t;
-        #endif
-        double t1 = 1.0-cumulative;
-        double t3 = 1.0-cumulative+arr[i];
-        double t4 = cumulative-arr[i];
-        double bin_coeff = 1.0; // exceeds 2**64; have to use double
-        double out = 0.0;
-        for (int64_t j = 0; j < num-pos+1; j++) {
-            double temp = pow(t1, j) * pow(cumulative, num-j) - pow(t3, j) * pow(t4, num-j);
-            out += temp * bin_coeff;
-            bin_coeff *= (num-j)/((double)(j+1));
+        cdf[i] = cumulative;
+    }
+    double total = cumulative;
+    cumulative = comp = 0.0;
+    for (int64_t i = len-1; i >= 0; i--) {
+        sf[i] = cumulative/total;
+        double y = arr[i] - comp;
+        double t = cumulative + y;
+        comp = (t - cumulative) - y;
+        cumulative = t;
+        cdf[i] /= total;
+    }
+    #endif
+    const double a = pos;
+    const double b = num-pos+1;
+    const double lbeta = lgamma(a) + lgamma(b) - lgamma(a+b);
+    // overwrite cdf/sf with P(order stat <= i) and P(order stat > i)
+    #pragma omp parallel for if (len >= ORDER_STAT_PARALLEL_LEN)
+    for (int64_t i = 0; i < len; i++) {
+        reg_inc_beta(a, b, lbeta, cdf[i], sf[i], cdf+i, sf+i);
+    }
+    double prev_lower = 0.0;
+    double prev_upper = 1.0;
+    for (int64_t i = 0; i < len; i++) {
+        // Use whichever difference involves smaller numbers
+        if (cdf[i] < 0.5) {
+            arr[i] = cdf[i] - prev_lower;
+        } else {
+            arr[i] = prev_upper - sf[i];
         }
-        arr[i] = out;
+        prev_lower = cdf[i];
+        prev_upper = sf[i];
     }
+    free(cdf);
+    free(sf);
 }
 /*
 WIP
@@ -5,7 +5,11 @@
 #include <string.h>
 #include <float.h>
 #include <stdint.h>
+#include <time.h>
 #include "pocketfft/pocketfft.h"
+#include "defs.c"
+#include "ntt.c"
+#include "ndm_tables.c"
 
 // This file contains various algorithms which are used on arrays.
 
@@ -15,6 +19,126 @@ typedef double complex complex128_t;
 #define M_PI (3.14159265358979323846)
 #endif
 
+// Building an rfft plan means computing twiddle factors, which is a lot of
+// trig calls. Lots of expressions (eg 3d6+3d6+3d6) transform the same length
+// over and over, so we keep recently used plans around, keyed by length.
+// Plans are owned by the cache; callers must never destroy them.
+// Maximum number of plans we keep at once
+#define PLAN_CACHE_SIZE 32
+// Maximum (estimated) memory used by cached plans, in bytes
+#define PLAN_CACHE_MAX_BYTES (64LL*1024*1024)
+
+typedef struct PlanCacheEntry {
+    rfft_plan plan;
+    size_t len;
+    size_t bytes;
+    uint64_t last_used; // 0 means this slot is empty
+} PlanCacheEntry;
+
+typedef struct PlanCache {
+    PlanCacheEntry entries[PLAN_CACHE_SIZE];
+    size_t bytes;
+    uint64_t clock;
+} PlanCache;
+
+/**
+ * \return The current context's plan cache, which is made the first time
+ * it's needed
+ */
+PlanCache* get_plan_cache() {
+    if (CTX->plan_cache == NULL) {
+        CTX->plan_cache = calloc(1, sizeof(PlanCache));
+    }
+    return CTX->plan_cache;
+}
+
+/**
+ * Rough estimate of how much memory pocketfft uses for a plan. It stores
+ * about one twiddle factor per element, Bluestein plans (for lengths with
+ * large prime factors) use a few times more, so we err on the big side.
+ *
+ * \param len Transform length
+ * \return Estimated size of plan in bytes
+ */
+size_t estimate_plan_bytes(const size_t len) {
+    return 4*len*sizeof(double) + 256;
+}
+
+/**
+ * Destroys the plan in the given cache slot and marks the slot as empty.
+ *
+ * \param i Index into cache->entries
+ */
+void evict_rfft_plan(PlanCache* cache, const int i) {
+    destroy_rfft_plan(cache->entries[i].plan);
+    cache->bytes -= cache->entries[i].bytes;
+    cache->entries[i].plan = NULL;
+    cache->entries[i].len = 0;
+    cache->entries[i].bytes = 0;
+    cache->entries[i].last_used = 0;
+}
+
+/**
+ * Returns an rfft plan for the given length, building it only if we don't
+ * already have one cached. Least recently used plans are evicted when the
+ * cache is full or over its memory budget.
+ *
+ * The returned plan belongs to the cache, so don't destroy it. It stays valid
+ * until the next call to get_rfft_plan with a different length.
+ *
+ * \param len Transform length
+ * \return rfft plan for len
+ */
+rfft_plan get_rfft_plan(const size_t len) {
+    PlanCache* cache = get_plan_cache();
+    int empty = -1;
+    cache->clock++;
+    for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        if (cache->entries[i].last_used == 0) {
+            empty = i;
+        } else if (cache->entries[i].len == len) {
+            cache->entries[i].last_used = cache->clock;
+            return cache->entries[i].plan;
+        }
+    }
+    const size_t bytes = estimate_plan_bytes(len);
+    // Evict until there's room. If the plan is bigger than the whole budget,
+    // this empties the cache and we keep it anyways.
+    while (empty == -1 || (cache->bytes > 0
+                           && cache->bytes + bytes > PLAN_CACHE_MAX_BYTES)) {
+        int oldest = -1;
+        for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+            if (cache->entries[i].last_used != 0 && (oldest == -1
+                    || cache->entries[i].last_used < cache->entries[oldest].last_used)) {
+                oldest = i;
+            }
+        }
+        evict_rfft_plan(cache, oldest);
+        empty = oldest;
+    }
+    rfft_plan plan = make_rfft_plan(len);
+    if (plan == NULL) {
+        return NULL;
+    }
+    cache->entries[empty].plan = plan;
+    cache->entries[empty].len = len;
+    cache->entries[empty].bytes = bytes;
+    cache->entries[empty].last_used = cache->clock;
+    cache->bytes += bytes;
+    return plan;
+}
+
+/**
+ * Destroys every plan in a cache.
+ */
+void clear_rfft_plan_cache(PlanCache* cache) {
+    for (int i = 0; i < PLAN_CACHE_SIZE; i++) {
+        if (cache->entries[i].last_used != 0) {
+            evict_rfft_plan(cache, i);
+        }
+    }
+}
+
 /**
  * Raises a complex double (stored as pair of doubles) to a power, in place.
  * 
@@ -31,22 +155,6 @@ void ip_unaligned_cpow(double* first, const int n) {
     first[1] = cimag(x);
 }
 
-/**
- * `out[i] += pow(first[i], n)` but we're dealing with complex doubles
- * stored as pairs of doubles.
- * \param[in] first Pointer to real part of complex double.
- * \param[out] out Where to put the output.
- * \param n Desired power
- * \param factor Fourier transform time shifting factor
- */
-void accum_unaligned_cpow(const double* first, double* out, const int64_t n,
-                          const double factor, const complex128_t rotate) {
-    complex128_t x = first[0] + I*(first[1]);
-    x = rotate * factor * cpow(x, n);
-    out[0] += creal(x);
-    out[1] += cimag(x);
-}
-
 /**
  * Raises an array of complex numbers to the power n, elementwise.
  * 
@@ -72,35 +180,6 @@ void exponentiate_forward_rfft(double arr[], const int64_t len, const int n) {
     }
 }
 
-/**
- * Essentially does the following vectorized operation:
- * 
- * `to += exponentiate_forward_fft(from, len, n);`
- *
- * \param[in] from Input array
- * \param[in,out] to Output array to be modified
- * \param factor Fourier transform time shifting factor
- * \param len Length of from
- * \param n Desired power
- * \param offset Time-domain offset
- */
-void accum_exp_forward_rfft(const double from[], double to[], const double factor,
-                            const int64_t len, const int n, const int64_t offset) {
-    to[0] += factor * pow(from[0], n);
-    int j = 0;
-    for (int64_t i = 1; i < len-1; i+= 2) {
-        j++;
-        // multiply each element by by e^{-2pi I i/outlen} where I is sqrt(-1)
-        complex128_t rotate = cos((-2*M_PI*j*offset)/len) + I*sin((-2*M_PI*j*offset)/len);
-        accum_unaligned_cpow(from+i, to+i, n, factor, rotate);
-    }
-    if (len%2 == 0) {
-        j++;
-        complex128_t rotate = cos((-2*M_PI*j*offset)/len) + I*sin((-2*M_PI*j*offset)/len);
-        to[len-1] += rotate*factor*pow(from[len-1], n);
-    }
-}
-
 /**
  * Debug print function to print complex arrays as stored by the FFT library
  * I'm using.
@@ -133,6 +212,336 @@ void print_real_arr(const double start[], const int64_t len) {
     printf("]\n");
 }
 
+// For short operands, direct convolution (a few multiply-adds per output
+// element) is much faster than zero padding and doing three FFTs. We take the
+// direct route whenever the number of multiply-adds per output element is at
+// most conv_crossover. The default was measured on my computer; it can be
+// overridden with the environment variable DICE_CONV_CROSSOVER, which is
+// either a number or "auto" to calibrate at startup.
+#define CONV_CROSSOVER_DEFAULT 64
+int64_t conv_crossover = CONV_CROSSOVER_DEFAULT;
+
+/**
+ * Direct convolution, ie out[i+j] += x[i]*y[j] for all i, j.
+ *
+ * \param[in] x Input array 1
+ * \param xlen Length of x
+ * \param[in] y Input array 2
+ * \param ylen Length of y
+ * \param[out] out Output array of length xlen+ylen-1. Must be zeroed.
+ */
+void direct_convolve(const double* restrict x, const int64_t xlen,
+                     const double* restrict y, const int64_t ylen,
+                     double* restrict out) {
+    for (int64_t i = 0; i < xlen; i++) {
+        const double xi = x[i];
+        if (xi == 0.0) {
+            continue;
+        }
+        double* restrict row = out+i;
+        #pragma omp simd
+        for (int64_t j = 0; j < ylen; j++) {
+            row[j] += xi*y[j];
+        }
+    }
+}
+
+/**
+ * Convolves x with itself n times by direct summation, in place.
+ *
+ * We overwrite arr from the top down, and arr[k] only depends on arr[0..k],
+ * so every step can be done without a second buffer.
+ *
+ * \param[in] x Input array (must not overlap arr)
+ * \param len Length of x
+ * \param n Number of copies of x to add together (n >= 1)
+ * \param[out] arr Output array, of length at least (len-1)*n+1
+ */
+void direct_autoconvolve(const double* restrict x, const int64_t len,
+                         const int64_t n, double* restrict arr) {
+    memcpy(arr, x, len*sizeof(double));
+    int64_t cur = len;
+    for (int64_t step = 1; step < n; step++) {
+        const int64_t next = cur+len-1;
+        for (int64_t k = next-1; k >= 0; k--) {
+            const int64_t lo = (k-cur+1 > 0) ? k-cur+1 : 0;
+            const int64_t hi = (k < len-1) ? k : len-1;
+            double sum = 0.0;
+            #pragma omp simd reduction(+:sum)
+            for (int64_t j = lo; j <= hi; j++) {
+                sum += x[j]*arr[k-j];
+            }
+            arr[k] = sum;
+        }
+        cur = next;
+    }
+}
+
+/**
+ * Decides whether a convolution should be done directly rather than with FFTs.
+ *
+ * \param work_per_output Number of multiply-adds the direct method needs per
+ * output element
+ * \return True if direct convolution should be used
+ */
+int use_direct_convolution(const int64_t work_per_output) {
+    return work_per_output <= conv_crossover;
+}
+
+double* convolve(double* x, const int64_t xlen, double* y,
+                 const int64_t ylen, int64_t* new_len);
+
+/**
+ * Finds the crossover point between direct and FFT convolution on this
+ * machine, by timing both on a long array convolved with arrays of
+ * increasing length, and stores it in conv_crossover.
+ */
+void calibrate_conv_crossover() {
+    const int64_t long_len = 4096;
+    int64_t crossover = 1;
+    for (int64_t short_len = 2; short_len <= 1024; short_len *= 2) {
+        clock_t times[2];
+        for (int method = 0; method < 2; method++) {
+            conv_crossover = method ? 0 : short_len;
+            clock_t start = clock();
+            for (int rep = 0; rep < 8; rep++) {
+                double* x = malloc(long_len*sizeof(double));
+                double* y = malloc(short_len*sizeof(double));
+                for (int64_t i = 0; i < long_len; i++) {
+                    x[i] = 1.0/long_len;
+                }
+                for (int64_t i = 0; i < short_len; i++) {
+                    y[i] = 1.0/short_len;
+                }
+                int64_t out_len;
+                free(convolve(x, long_len, y, short_len, &out_len));
+            }
+            times[method] = clock()-start;
+        }
+        if (times[0] > times[1]) {
+            break;
+        }
+        crossover = short_len;
+    }
+    conv_crossover = crossover;
+}
+
+/**
+ * Sets conv_crossover from the environment variable DICE_CONV_CROSSOVER,
+ * if it's set.
+ */
+void init_conv_crossover() {
+    const char* env = getenv("DICE_CONV_CROSSOVER");
+    if (env == NULL) {
+        return;
+    }
+    if (strcmp(env, "auto") == 0) {
+        calibrate_conv_crossover();
+        return;
+    }
+    char* end;
+    long long val = strtoll(env, &end, 10);
+    if (end != env && *end == '\0' && val >= 0) {
+        conv_crossover = val;
+    }
+}
+
+// If true, convolutions that would otherwise use the FFT use the exact NTT
+// backend in ntt.c instead, whenever the inputs are (multiples of) integer
+// counts. Set by the environment variable DICE_EXACT.
+int exact_mode = 0;
+
+/**
+ * Sets exact_mode from the environment variable DICE_EXACT, if it's set.
+ */
+void init_exact_mode() {
+    const char* env = getenv("DICE_EXACT");
+    exact_mode = (env != NULL && strcmp(env, "") != 0 && strcmp(env, "0") != 0);
+}
+
+/**
+ * Says that exact mode is falling back to the FFT for a convolution. That
+ * happens when an input isn't made of whole counts or they're too spread out
+ * (see recover_counts), or when the output is too big for ntt.c.
+ */
+void warn_not_exact() {
+    fprintf(ERR_STREAM, "A sum is too big or uneven for exact mode, using floating point.\n");
+}
+
+/**
+ * Computes base^n as mant*2^exp, so that the result can't overflow or
+ * underflow.
+ *
+ * \param base Positive number
+ * \param n Nonnegative power
+ * \param[out] mant Where the mantissa is stored
+ * \param[out] exp Where the binary exponent is stored
+ */
+void scaled_pow(const double base, int64_t n, double* mant, int64_t* exp) {
+    int e;
+    double b = frexp(base, &e);
+    int64_t b_exp = e;
+    double m = 1.0;
+    int64_t m_exp = 0;
+    while (n) {
+        if (n & 1) {
+            m = frexp(m*b, &e);
+            m_exp += b_exp + e;
+        }
+        b = frexp(b*b, &e);
+        b_exp = 2*b_exp + e;
+        n >>= 1;
+    }
+    *mant = m;
+    *exp = m_exp;
+}
+
+/**
+ * Tries to write the array x as scale*counts, where counts are nonnegative
+ * integers and scale is the smallest nonzero entry of x. This works for the
+ * output of ndm, sums of dice, most drop/keep results, etc.
+ *
+ * \param[in] x Input array
+ * \param len Length of x
+ * \param[out] counts Where the counts are stored, length len
+ * \param[out] scale Where the scale is stored
+ * \param[out] log2_total Where log2(sum of counts) is stored
+ * \return 0 on success, -1 if x isn't a multiple of small integers
+ */
+int recover_counts(const double* x, const int64_t len, uint64_t* counts,
+                   double* scale, double* log2_total) {
+    double smallest = 0.0;
+    for (int64_t i = 0; i < len; i++) {
+        if (x[i] < 0.0) {
+            return -1;
+        }
+        if (x[i] > 0.0 && (smallest == 0.0 || x[i] < smallest)) {
+            smallest = x[i];
+        }
+    }
+    if (smallest == 0.0) {
+        return -1;
+    }
+    double total = 0.0;
+    for (int64_t i = 0; i < len; i++) {
+        double ratio = x[i]/smallest;
+        // x[i] and smallest are both rounded, so ratio can be off by about
+        // 3e-16 times itself. Up to 2^49 that's well under 1/4, so we can
+        // still round it to the right count. Bigger counts than that can't be
+        // carried in doubles, eg the middle of 30d6.
+        if (ratio > 0x1p49) {
+            return -1;
+        }
+        double count = rint(ratio);
+        if (fabs(ratio-count) > fmin(1e-12*count, 0.25)) {
+            return -1;
+        }
+        counts[i] = (uint64_t)count;
+        total += count;
+    }
+    *scale = smallest;
+    *log2_total = log2(total);
+    return 0;
+}
+
+/**
+ * Exact version of autoconvolve's FFT route. Leaves x alone on failure.
+ *
+ * \param[in] x Input array
+ * \param len Length of x
+ * \param n Number of times to convolve (n >= 1)
+ * \param[out] out Output array of length (len-1)*n+1
+ * \return 0 on success, -1 if the exact backend can't handle this input
+ */
+int exact_autoconvolve(const double* x, const int64_t len, const int64_t n,
+                       double* out) {
+    uint64_t* counts = malloc(len*sizeof(uint64_t));
+    double scale, log2_total;
+    int code = recover_counts(x, len, counts, &scale, &log2_total);
+    if (code == 0) {
+        double mant;
+        int64_t exp;
+        scaled_pow(scale, n, &mant, &exp);
+        code = ntt_exact_convolve(counts, len, n, NULL, 0, n*log2_total,
+                                  mant, exp, out);
+    }
+    free(counts);
+    return code;
+}
+
+/**
+ * Exact version of convolve's FFT route. Leaves x and y alone on failure.
+ *
+ * \param[in] x Input array 1
+ * \param xlen Length of x
+ * \param[in] y Input array 2
+ * \param ylen Length of y
+ * \param[out] out Output array of length xlen+ylen-1
+ * \return 0 on success, -1 if the exact backend can't handle these inputs
+ */
+int exact_convolve(const double* x, const int64_t xlen, const double* y,
+                   const int64_t ylen, double* out) {
+    uint64_t* xcounts = malloc(xlen*sizeof(uint64_t));
+    uint64_t* ycounts = malloc(ylen*sizeof(uint64_t));
+    double xscale, yscale, xbits, ybits;
+    int code = recover_counts(x, xlen, xcounts, &xscale, &xbits);
+    if (code == 0) {
+        code = recover_counts(y, ylen, ycounts, &yscale, &ybits);
+    }
+    if (code == 0) {
+        int xe, ye;
+        double mant = frexp(xscale, &xe)*frexp(yscale, &ye);
+        code = ntt_exact_convolve(xcounts, xlen, 1, ycounts, ylen, xbits+ybits,
+                                  mant, xe+ye, out);
+    }
+    free(xcounts);
+    free(ycounts);
+    return code;
+}
+
+/**
+ * Exact version of ndm's FFT route, ie the counts of ways to roll each total
+ * with n m-faced dice, divided by m^n.
+ *
+ * \param n Number of dice
+ * \param m Number of faces on each die
+ * \param[out] out Output array of length at least n*(m-1)+1
+ * \return 0 on success, -1 if the exact backend can't handle this input
+ */
+int exact_ndm(const int n, const int m, double* out) {
+    uint64_t* die = malloc(m*sizeof(uint64_t));
+    for (int i = 0; i < m; i++) {
+        die[i] = 1;
+    }
+    double mant;
+    int64_t exp;
+    scaled_pow(m, n, &mant, &exp);
+    int code = ntt_exact_convolve(die, m, n, NULL, 0, n*log2(m), 1.0/mant, -exp, out);
+    free(die);
+    return code;
+}
+
+/**
+ * Looks up NdM in the precomputed tables from ndm_tables.c (made by
+ * gen_ndm_tables.c).
+ *
+ * \param n Number of dice
+ * \param m Number of faces on each die
+ * \return Pointer to the table's PMF (length n*(m-1)+1), or NULL if NdM
+ * isn't in the tables
+ */
+const double* ndm_table_lookup(const int n, const int m) {
+    if (n > NDM_TABLE_MAX_N) {
+        return NULL;
+    }
+    for (int i = 0; i < ndm_tables_len; i++) {
+        if (ndm_tables[i].n == n && ndm_tables[i].m == m) {
+            return ndm_tables[i].pmf;
+        }
+    }
+    return NULL;
+}
+
 /**
  * Finds the PMF of the distribution given by rolling n m-faced die
  * and adding up the results.
@@ -145,6 +554,12 @@ void print_real_arr(const double start[], const int64_t len) {
  * `x` is `arr[x-n]`
  */
 double* ndm(const int n, const int m) {
+    const double* table = ndm_table_lookup(n, m);
+    if (table != NULL) { // common pools like 3d6 are precomputed
+        double* out = calloc(m*n, sizeof(double));
+        memcpy(out, table, ((int64_t)n*(m-1)+1)*sizeof(double));
+        return out;
+    }
     double* x = calloc(m*n, sizeof(double));
     int too_big = log2(n)*m > 52;
     // when n=m=150, n^m is too big to store as a double.
@@ -161,11 +576,24 @@ double* ndm(const int n, const int m) {
     //}
     // The PMF of the sum of two random variables is the convolution of their
     // PMFs, so we want x conv x conv x ...
-    // By the convolution theorem, this is IFFT(FFT(X)**n),
-    rfft_plan plan = make_rfft_plan(n*m);
-    rfft_forward(plan, x, 1.0);
-    exponentiate_forward_rfft(x, n*m, n);
-    rfft_backward(plan, x, 1.0/(n*m));
+    if (use_direct_convolution((int64_t)m*n/2)) {
+        // Small pools like 2d6: a few multiply-adds per entry
+        double* die = malloc(m*sizeof(double));
+        memcpy(die, x, m*sizeof(double));
+        direct_autoconvolve(die, m, n, x);
+        free(die);
+    } else if (exact_mode && exact_ndm(n, m, x) == 0) {
+        return x;
+    } else {
+        if (exact_mode) {
+            fprintf(ERR_STREAM, "%dd%d is too big for exact mode, using floating point.\n", n, m);
+        }
+        // By the convolution theorem, this is IFFT(FFT(X)**n),
+        rfft_plan plan = get_rfft_plan(n*m);
+        rfft_forward(plan, x, 1.0);
+        exponentiate_forward_rfft(x, n*m, n);
+        rfft_backward(plan, x, 1.0/(n*m));
+    }
     if (!too_big) {
         val = pow(m,n);
         for (int64_t i = 0; i < n*m; i++) {
@@ -190,6 +618,31 @@ void flip(double* arr, const int64_t len) {
     }
 }
 
+/**
+ * Distribution of keeping the highest (or lowest) one of n m-faced dice, ie
+ * the max (or min) of n dice, without going through drop.cpp.
+ *
+ * P(max == v) = (v^n - (v-1)^n)/m^n, which we write as
+ * (v/m)^n * (1 - (1-1/v)^n) so that neither tail loses precision.
+ *
+ * \param n Number of dice
+ * \param m Number of faces on each die
+ * \param highest True for the max, false for the min
+ * \return Array of length m such that the probability of getting x is arr[x-1]
+ */
+double* keep_one(const int n, const int m, const int highest) {
+    double* out = malloc(m*sizeof(double));
+    out[0] = pow(1.0/m, n);
+    for (int v = 2; v <= m; v++) {
+        out[v-1] = pow((double)v/m, n) * -expm1(n*log1p(-1.0/v));
+    }
+    if (!highest) {
+        // The min of n dice is the max of n dice, flipped.
+        flip(out, m);
+    }
+    return out;
+}
+
 /**
  * Convolves x with itself n times.
  * 
@@ -208,14 +661,24 @@ double* autoconvolve(double* x, const int64_t len, int64_t n, int64_t* outlenptr
     int64_t outlen = (len-1)*n + 1;
     *outlenptr = outlen;
     double* out = calloc(outlen, sizeof(double));
-    memcpy(out, x, len*sizeof(double));
-    free(x);
-    // We use the convolution theorem, as out conv out conv out...
-    // is IFFT(FFT(out)**n)
-    rfft_plan plan = make_rfft_plan(outlen);
-    rfft_forward(plan, out, 1.0);
-    exponentiate_forward_rfft(out, outlen, n);
-    rfft_backward(plan, out, 1.0/outlen);
+    if (use_direct_convolution(len*n/2)) {
+        direct_autoconvolve(x, len, n, out);
+        free(x);
+    } else if (exact_mode && exact_autoconvolve(x, len, n, out) == 0) {
+        free(x);
+    } else {
+        if (exact_mode) {
+            warn_not_exact();
+        }
+        memcpy(out, x, len*sizeof(double));
+        free(x);
+        // We use the convolution theorem, as out conv out conv out...
+        // is IFFT(FFT(out)**n)
+        rfft_plan plan = get_rfft_plan(outlen);
+        rfft_forward(plan, out, 1.0);
+        exponentiate_forward_rfft(out, outlen, n);
+        rfft_backward(plan, out, 1.0/outlen);
+    }
     if (negative) {
         flip(out, outlen);
     }
@@ -261,6 +724,29 @@ double* grow_by_int(double* arr, const int64_t len, int n, int64_t* new_size) {
  */
 double* convolve(double* x, const int64_t xlen, double* y,
                  const int64_t ylen, int64_t* new_len) {
+    if (use_direct_convolution(xlen < ylen ? xlen : ylen)) {
+        *new_len = xlen+ylen-1;
+        double* out = calloc(xlen+ylen-1, sizeof(double));
+        if (xlen < ylen) {
+            direct_convolve(x, xlen, y, ylen, out);
+        } else {
+            direct_convolve(y, ylen, x, xlen, out);
+        }
+        free(x);
+        free(y);
+        return out;
+    }
+    if (exact_mode) {
+        double* out = malloc((xlen+ylen-1)*sizeof(double));
+        if (exact_convolve(x, xlen, y, ylen, out) == 0) {
+            *new_len = xlen+ylen-1;
+            free(x);
+            free(y);
+            return out;
+        }
+        free(out);
+        warn_not_exact();
+    }
     // pad
     int64_t len = xlen + ylen;
     *new_len = len-1;
@@ -273,7 +759,7 @@ double* convolve(double* x, const int64_t xlen, double* y,
         y[i] = 0.0;
     }
     // irfft(rfft(x) * rfft(y)) via convolution theorem
-    rfft_plan plan = make_rfft_plan(len);
+    rfft_plan plan = get_rfft_plan(len);
     rfft_forward(plan, x, 1.0);
     rfft_forward(plan, y, 1.0);
     x[0] *= y[0];
@@ -319,8 +805,42 @@ void multiply_pmfs_bounds(const int64_t xlen, const int64_t ylen, const int64_t
     *upper = max;
 }
 
+/**
+ * Floor division, ie rounds towards negative infinity. C rounds towards 0.
+ * \param a Numerator
+ * \param b Nonzero denominator
+ * \return floor(a/b)
+ */
+int64_t floor_div(const int64_t a, const int64_t b) {
+    int64_t q = a/b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) {
+        q--;
+    }
+    return q;
+}
+
+/**
+ * Ceiling division, ie rounds towards positive infinity.
+ * \param a Numerator
+ * \param b Nonzero denominator
+ * \return ceil(a/b)
+ */
+int64_t ceil_div(const int64_t a, const int64_t b) {
+    return -floor_div(-a, b);
+}
+
+// multiply_pmfs splits its output into blocks of this many doubles, each of
+// which is filled in by one thread. 32K doubles is 256 KiB, which fits in L2.
+#define PRODUCT_BLOCK_LEN (32*1024)
+
 /**
  * Gives the distribution of the product of two RVs
+ *
+ * out[(i+xleft)*(j+yleft)-lower] += x[i]*y[j] writes all over the output,
+ * which thrashes the cache once the output is big. Instead, we split the
+ * output into blocks, and for each block find the (contiguous) range of j
+ * that lands in it for each row i. Each block is owned by one thread, so
+ * threads never write to the same memory and there's nothing to reduce.
  * 
  * \param[in] x PMF of one RV (gets freed)
  * \param xlen Length of array x
@@ -336,17 +856,58 @@ double* multiply_pmfs(double* x, const int64_t xlen,
                      double* y, const int64_t ylen,
                      const int64_t xleft, int64_t const yleft,
                      int64_t* lower, int64_t* upper) {
-    // int64_t lower, upper;
     multiply_pmfs_bounds(xlen, ylen, xleft, yleft, lower, upper);
-    double* out = calloc((*upper)-(*lower)+1, sizeof(double));
+    const int64_t low = *lower;
+    const int64_t outlen = (*upper)-low+1;
+    double* out = calloc(outlen, sizeof(double));
     // I know that *technically* out[0] need not be 0. If you've managed to
     // find some esoteric computer where this isn't an array of all 0.0,
     // then that's your problem.
-    int64_t index;
-    for (int64_t i = 0; i < xlen; i++) {
-        for (int64_t j = 0; j < ylen; j++) {
-            index = (i+xleft)*(j+yleft)-(*lower);
-            out[index] += x[i]*y[j];
+    // Rows are the shorter array, since we look at every row for every block.
+    const double* rows = (xlen <= ylen) ? x : y;
+    const double* cols = (xlen <= ylen) ? y : x;
+    const int64_t rowlen = (xlen <= ylen) ? xlen : ylen;
+    const int64_t collen = (xlen <= ylen) ? ylen : xlen;
+    const int64_t rowleft = (xlen <= ylen) ? xleft : yleft;
+    const int64_t colleft = (xlen <= ylen) ? yleft : xleft;
+    double colsum = 0.0;
+    for (int64_t j = 0; j < collen; j++) {
+        colsum += cols[j];
+    }
+    const int64_t num_blocks = (outlen + PRODUCT_BLOCK_LEN - 1)/PRODUCT_BLOCK_LEN;
+    #pragma omp parallel for schedule(dynamic) if (num_blocks > 1)
+    for (int64_t block = 0; block < num_blocks; block++) {
+        // abscissa values covered by this block
+        const int64_t block_lo = low + block*PRODUCT_BLOCK_LEN;
+        const int64_t block_hi = (block == num_blocks-1)
+                               ? (*upper) : block_lo + PRODUCT_BLOCK_LEN - 1;
+        for (int64_t i = 0; i < rowlen; i++) {
+            const double weight = rows[i];
+            if (weight == 0.0) {
+                continue;
+            }
+            const int64_t a = i + rowleft;
+            if (a == 0) {
+                if (block_lo <= 0 && 0 <= block_hi) {
+                    out[-low] += weight*colsum;
+                }
+                continue;
+            }
+            // range of j such that block_lo <= a*(j+colleft) <= block_hi
+            int64_t jlo, jhi;
+            if (a > 0) {
+                jlo = ceil_div(block_lo, a) - colleft;
+                jhi = floor_div(block_hi, a) - colleft;
+            } else {
+                jlo = ceil_div(block_hi, a) - colleft;
+                jhi = floor_div(block_lo, a) - colleft;
+            }
+            jlo = (jlo < 0) ? 0 : jlo;
+            jhi = (jhi >= collen) ? collen-1 : jhi;
+            double* dest = out + a*colleft - low;
+            for (int64_t j = jlo; j <= jhi; j++) {
+                dest[a*j] += weight*cols[j];
+            }
         }
     }
     free(x);
@@ -354,9 +915,36 @@ double* multiply_pmfs(double* x, const int64_t xlen,
     return out;
 }
 
+/**
+ * Raises a complex number to a nonnegative integer power by repeated squaring.
+ *
+ * \param z Base
+ * \param n Power
+ * \return z^n
+ */
+complex128_t cpow_int(complex128_t z, int64_t n) {
+    complex128_t out = 1.0;
+    while (n) {
+        if (n & 1) {
+            out *= z;
+        }
+        z *= z;
+        n >>= 1;
+    }
+    return out;
+}
+
 /**
  * Non-commutative multiplication of two RVs. Represents sampling the left RV
  * then returning the sum of that many copies of the right RV.
+ *
+ * We do this with probability generating functions. If Z is the Fourier
+ * transform of the right RV (with its offset baked in), then the transform of
+ * n copies of it is Z^n, so the transform of the output is
+ * sum_n P(x==n) Z^n, a polynomial in Z which we evaluate with Horner's method
+ * at every frequency. Negative n are the same thing with conj(Z), which is
+ * the transform of the negated right RV. All of the phase rotations come from
+ * one table of roots of unity, so there's no trig in the inner loop.
  * 
  * \param x PMF of left RV (gets freed)
  * \param xlen Length of array x
@@ -372,65 +960,55 @@ double* at_multiply_pmfs(double* x, const int64_t xlen, double* y, const int64_t
                          const int64_t xleft, const int64_t yleft,
                          int64_t* lower, int64_t* upper) {
     multiply_pmfs_bounds(xlen, ylen, xleft, yleft, lower, upper);
-    //printf("at_multiply_pmfs lower:%ld, upper: %ld\n", *lower, *upper);
-    int64_t outlen = (*upper)-(*lower)+1;
+    const int64_t outlen = (*upper)-(*lower)+1;
+    const int64_t xright = xleft+xlen-1;
     double* out = calloc(outlen, sizeof(double));
-    double* forward = calloc(outlen, sizeof(double));
-    memcpy(forward, y, ylen*sizeof(double));
-    rfft_plan plan = make_rfft_plan(outlen);
-    rfft_forward(plan, forward, 1.0);
-    //printf("forward\n");
-    //print_rfft_forward(forward, outlen);
-    // x[i]: P(x == n)
-    // n > 0
-    for (int64_t n = 1; n < xleft+xlen; n++) {
-        int64_t i = n-xleft;
-        // we need to offset this part in the "time" domain.
-        // To avoid re-calculating FFTs, we rotate in the frequency domain
-        //call signature: (from, to, factor, len, n, offset);
-        //printf("n: %ld, offset: %ld\n", n, n*yleft-(*lower));
-        accum_exp_forward_rfft(forward, out, x[i], outlen, n, n*yleft-(*lower));
-        //printf("out after n=%ld, x[%ld]=%f:\n", n, i, x[i]);
-        //print_rfft_forward(out, outlen);
-    }
-    if (xleft < 0) { // n < 0
-        memset(forward, 0, outlen*sizeof(double));
-        memcpy(forward, y, ylen*sizeof(double));
-        flip(forward, outlen);
-        rfft_forward(plan, forward, 1.0);
-    }
-    //int j = 0;
-    for (int64_t n = xleft; n < 0 && n < xleft+xlen; n++) {
-        //printf("n: %ld\n", n);
-        int64_t i = n-xleft;
-        int64_t right_bound;
-        if (yleft == 0) {
-            right_bound = 0;//n*(yleft+ylen-1);
-            //printf("right_bound: %ld\n", right_bound);
-        } else {
-            // bound could be 0
-            right_bound = n*yleft;
-            //printf("right_bound: %ld\n", right_bound);
+    memcpy(out, y, ylen*sizeof(double));
+    rfft_plan plan = get_rfft_plan(outlen);
+    rfft_forward(plan, out, 1.0);
+    // roots[j] = e^{-2pi I j/outlen}
+    complex128_t* roots = malloc(outlen*sizeof(complex128_t));
+    for (int64_t j = 0; j < outlen; j++) {
+        roots[j] = cos((-2*M_PI*j)/outlen) + I*sin((-2*M_PI*j)/outlen);
+    }
+    // Rotating by roots[k*a mod outlen] shifts by a in the time domain.
+    const int64_t yshift = ((yleft % outlen) + outlen) % outlen;
+    const int64_t outshift = (((-*lower) % outlen) + outlen) % outlen;
+    for (int64_t k = 0; 2*k <= outlen; k++) {
+        // k-th frequency bin, in pocketfft's layout
+        double* re = (k == 0) ? out : out+2*k-1;
+        double* im = (k == 0 || 2*k == outlen) ? NULL : out+2*k;
+        complex128_t z = *re + I*(im ? *im : 0.0);
+        z *= roots[(k*yshift) % outlen];
+        complex128_t acc = 0.0;
+        if (xright >= 0) {
+            // n >= 0: sum_n x[n-xleft] z^n
+            const int64_t first = (xleft > 0) ? xleft : 0;
+            for (int64_t n = xright; n >= first; n--) {
+                acc = acc*z + x[n-xleft];
+            }
+            acc *= cpow_int(z, first);
+        }
+        if (xleft < 0) {
+            // n < 0: sum_n x[n-xleft] conj(z)^(-n)
+            const complex128_t zc = conj(z);
+            const int64_t last = (xright < 0) ? xright : -1;
+            complex128_t neg = 0.0;
+            for (int64_t n = xleft; n <= last; n++) {
+                neg = neg*zc + x[n-xleft];
+            }
+            acc += neg * cpow_int(zc, -last);
+        }
+        acc *= roots[(k*outshift) % outlen];
+        *re = creal(acc);
+        if (im) {
+            *im = cimag(acc);
         }
-        right_bound -= n+1; // Offsets the fact that convolutions shift.
-        int64_t offset = right_bound - (*upper);
-        //printf(" offset: %ld\n", offset);
-        accum_exp_forward_rfft(forward, out, x[i], outlen, -n, offset);
     }
     rfft_backward(plan, out, 1.0/outlen);
-    // n = 0
-    if (xleft <= 0 && 0 < xleft+xlen) {
-        int64_t i = -xleft;
-        out[-(*lower)] += x[i];
-        //for (int64_t j = 0; j < outlen; j++) {
-        //    out[j] += x[i];
-        //}
-    }
+    free(roots);
     free(x);
     free(y);
-    free(forward);
-    //printf("out\n");
-    //print_real_arr(out, outlen);
     return out;
 }
 
@@ -473,6 +1051,11 @@ double* divide_indices(double* x, int64_t* x_len, int64_t* x_left, int64_t n) {
 /**
  * Finds the distribution of dividing the RV X by the RV Y, using C integer
  * division.
+ *
+ * For a fixed divisor d, the numerators that give each quotient q form a
+ * contiguous range, so instead of looking at every (x, y) pair we take range
+ * sums of a prefix sum of x. That's O(xlen/|d|) work per divisor instead of
+ * O(xlen).
  * 
  * \param[in] x The PMF of X (gets freed)
  * \param xlen The length of x
@@ -482,53 +1065,99 @@ double* divide_indices(double* x, int64_t* x_len, int64_t* x_left, int64_t n) {
  * \param yleft The abscissa value of y[0]
  * \param[out] outleftptr Location where the abscissa value of out[0] is stored
  * \param[out] outlenptr Location where length(out) is stored
- * \return Array storing PMF of X/Y.
+ * \return Array storing PMF of X/Y, or NULL if Y can be 0
  */
 double* divide_pmfs(double* x, const int64_t xlen, double* y, const int64_t ylen,
                     const int64_t xleft, const int64_t yleft,
                     int64_t* outleftptr, int64_t* outlenptr) {
-    // we calculate the minimum and maximum values of x/y
-    // this code is nasty but O(1) so idc
-    int64_t xmax = xleft + xlen - 1;
-    int64_t ymax = yleft + ylen - 1;
-    int64_t xbounds[2];
-    int64_t ybounds[2];
-    xbounds[0] = (xmax==0) ? -1 : xmax;
-    xbounds[1] = (xleft==0) ? 1 : xleft;
-    ybounds[0] = (ymax==0) ? -1 : ymax;
-    ybounds[1] = (yleft==0) ? 1 : yleft;
-    int64_t outleft = xbounds[0]/ybounds[0];
-    int64_t outstop = xbounds[0]/ybounds[0];
-    for (int i=0; i<2; i++) {
-        for (int j=0; j<2; j++) {
-            int64_t tmp = xbounds[i]/ybounds[j];
-            outleft = (outleft < tmp) ? outleft : tmp;
-            outstop = (outstop > tmp) ? outstop : tmp;
+    const int64_t xmax = xleft + xlen - 1;
+    if (yleft <= 0 && 0 < yleft+ylen && y[-yleft] != 0.0) {
+        // division by zero with nonzero probability
+        fprintf(ERR_STREAM, "Cannot divide by zero\n");
+        free(x);
+        free(y);
+        return NULL;
+    }
+    // For a fixed divisor, x/d is monotonic in x, so the bounds of the output
+    // come from the endpoints of x.
+    int64_t outleft = 0;
+    int64_t outstop = 0;
+    int first = 1;
+    for (int64_t j = 0; j < ylen; j++) {
+        const int64_t d = j + yleft;
+        if (d == 0 || y[j] == 0.0) {
+            continue;
+        }
+        const int64_t a = xleft/d;
+        const int64_t b = xmax/d;
+        const int64_t lo = (a < b) ? a : b;
+        const int64_t hi = (a < b) ? b : a;
+        if (first || lo < outleft) {
+            outleft = lo;
+        }
+        if (first || hi > outstop) {
+            outstop = hi;
         }
+        first = 0;
     }
-    // the loop. The idea is that we start with P(x/y==n) == 0 for all n,
-    // then for all possible values i,j of x,y, we do
-    // P(x/y == i/j) += P(x==i)*P(y==j)
+    const int64_t outlen = outstop-outleft+1;
     *outleftptr = outleft;
-    int64_t outlen = outstop-outleft+1;
     *outlenptr = outlen;
-    double* out = malloc(outlen*sizeof(double));
+    double* out = calloc(outlen, sizeof(double));
+    // prefix[i] = x[0] + ... + x[i-1]. Same deal as ip_cumsum, extended
+    // precision if we have it, since we take differences of these.
+    #if LDBL_MANT_DIG == 64
+    long double* prefix = malloc((xlen+1)*sizeof(long double));
+    long double sum = 0.0;
+    #else
+    double* prefix = malloc((xlen+1)*sizeof(double));
+    double sum = 0.0;
+    double c = 0.0;
+    #endif
+    prefix[0] = 0.0;
     for (int64_t i = 0; i < xlen; i++) {
-        for (int64_t j = 0; j < ylen; j++) {
-            if (j+yleft==0) {
-                // division by zero
-                if (y[j] == 0.0) {
-                    // probability 0, we can skip this
-                    continue;
-                }
-                // division by zero with nonzero probability
-                fprintf(stderr, "Cannot divide by zero\n");
-                Exit(1);
-                return out;
+        #if LDBL_MANT_DIG == 64
+        sum += x[i];
+        #else
+        double t1 = x[i] - c;
+        double t2 = sum + t1;
+        c = (t2-sum)-t1;
+        sum = t2;
+        #endif
+        prefix[i+1] = sum;
+    }
+    for (int64_t j = 0; j < ylen; j++) {
+        const int64_t d = j + yleft;
+        if (d == 0 || y[j] == 0.0) {
+            continue;
+        }
+        const int64_t abs_d = (d < 0) ? -d : d;
+        const int64_t qlo = (xleft/abs_d < xmax/abs_d) ? xleft/abs_d : xmax/abs_d;
+        const int64_t qhi = (xleft/abs_d < xmax/abs_d) ? xmax/abs_d : xleft/abs_d;
+        for (int64_t q = qlo; q <= qhi; q++) {
+            // numerators v with v/abs_d == q (C division truncates towards 0)
+            int64_t vlo, vhi;
+            if (q > 0) {
+                vlo = q*abs_d;
+                vhi = q*abs_d + abs_d-1;
+            } else if (q < 0) {
+                vlo = q*abs_d - (abs_d-1);
+                vhi = q*abs_d;
+            } else {
+                vlo = -(abs_d-1);
+                vhi = abs_d-1;
+            }
+            vlo = (vlo < xleft) ? xleft : vlo;
+            vhi = (vhi > xmax) ? xmax : vhi;
+            if (vlo > vhi) {
+                continue;
             }
-            out[(i+xleft)/(j+yleft)-outleft] += x[i]*y[j];
+            const double mass = prefix[vhi-xleft+1] - prefix[vlo-xleft];
+            const int64_t quotient = (d < 0) ? -q : q;
+            out[quotient-outleft] += mass*y[j];
         }
     }
+    free(prefix);
     free(x);
     free(y);
     return out;
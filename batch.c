@@ -0,0 +1,225 @@
+#ifndef BATCH_C
+#define BATCH_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include "defs.c"
+#include "dice.c"
+
+// This file implements batch mode, "dice --batch [file]", which reads one
+// expression per line from a file (or stdin, if there's no file or it's "-")
+// and prints the result of each one, in the same order as the input.
+//
+// The expressions are worked out on a pool of DICE_BATCH_JOBS threads (default:
+// one per core). Each thread has its own DiceContext, so its buffers, memo and
+// FFT plans are its own, and whatever it prints goes into a temporary file
+// instead of stdout. The drop cache, DICE_RESULT_CACHE and DICE_DROP_SNAPSHOT
+// are shared by all of them, and they lock what they need. An expression that
+// doesn't work just reports its error, but one that crashes takes the whole
+// batch with it.
+//
+// Each result is printed as a line "> expression" followed by whatever the
+// program would have printed (stdout and stderr) for that expression alone.
+
+#define BATCH_LINE_LEN 1024
+
+// How many lines we read at a time, per thread. The results are printed once
+// all of them are done.
+#define BATCH_WINDOW 16
+
+int handle_main(int argc, char const *argv[]); // in main.c
+
+typedef struct BatchJob {
+    char expr[BATCH_LINE_LEN];
+    int status; // 0 if it worked
+    char* out; // everything it printed
+    size_t out_len;
+    size_t out_cap;
+} BatchJob;
+
+// One for each thread in the pool
+typedef struct BatchWorker {
+    DiceContext* ctx;
+    FILE* buf; // where ctx prints to
+} BatchWorker;
+
+/**
+ * Wall clock time in seconds, for the throughput report.
+ */
+double wall_seconds() {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#elif defined(_WIN32)
+    return GetTickCount64()*1e-3;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+#endif
+}
+
+/**
+ * Reads the next non-empty line into buf, without the newline. Lines that
+ * are too long are replaced by an empty string in buf, so that the caller
+ * reports them as errors.
+ *
+ * \return 1 if a line was read, 0 at the end of the input
+ */
+int batch_read_line(FILE* in, char* buf) {
+    while (fgets(buf, BATCH_LINE_LEN, in) != NULL) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len-1] != '\n' && !feof(in)) {
+            // too long, skip the rest of it
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n');
+            buf[0] = '\0';
+            return 1;
+        }
+        while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) {
+            buf[--len] = '\0';
+        }
+        if (len > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints a finished job in the format described at the top of this file.
+ *
+ * \return 1 if the job failed, 0 otherwise
+ */
+int batch_print(const BatchJob* job) {
+    if (job->expr[0] == '\0') {
+        printf("> (line too long)\nInput too long.\n");
+        return 1;
+    }
+    printf("> %s\n", job->expr);
+    fwrite(job->out, 1, job->out_len, stdout);
+    return job->status != 0;
+}
+
+/**
+ * Works out job->expr in the worker's context, and keeps what it printed in
+ * job->out.
+ */
+void batch_run(BatchJob* job, BatchWorker* worker) {
+    job->out_len = 0;
+    job->status = 1;
+    if (job->expr[0] == '\0') {
+        return;
+    }
+    if (worker->ctx == NULL) {
+        worker->ctx = dice_ctx_new();
+        worker->buf = tmpfile();
+        worker->ctx->out = worker->buf;
+        worker->ctx->err = worker->buf;
+    }
+    const char* msg = "Couldn't make a temporary file for the output.\n";
+    if (worker->buf != NULL) {
+        DiceContext* const old = CTX;
+        CTX = worker->ctx;
+        char const *fake_argv[2] = {NULL, job->expr};
+        job->status = handle_main(2, fake_argv);
+        CTX = old;
+        job->out_len = ftell(worker->buf);
+        rewind(worker->buf);
+    } else {
+        job->out_len = strlen(msg);
+    }
+    if (job->out_cap < job->out_len) {
+        job->out_cap = job->out_len;
+        job->out = realloc(job->out, job->out_cap);
+    }
+    if (worker->buf != NULL) {
+        // the next job writes over this from the start, so only the length
+        // says where this one ends
+        job->out_len = fread(job->out, 1, job->out_len, worker->buf);
+        rewind(worker->buf);
+    } else {
+        memcpy(job->out, msg, job->out_len);
+    }
+}
+
+/**
+ * Runs batch mode on a file, see the top of this file.
+ *
+ * \param path File with one expression per line, or NULL or "-" for stdin
+ * \return 0 if every expression worked, 1 otherwise
+ */
+int batch_mode(const char* path) {
+    FILE* in = stdin;
+    if (path != NULL && strcmp(path, "-")) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            fprintf(stderr, "Can't open \"%s\".\n", path);
+            return 1;
+        }
+    }
+    int jobs = 1;
+#ifdef _OPENMP
+    jobs = omp_get_num_procs();
+#endif
+    const char* jobs_env = getenv("DICE_BATCH_JOBS");
+    if (jobs_env != NULL && atoi(jobs_env) > 0) {
+        jobs = atoi(jobs_env);
+    }
+    const double start = wall_seconds();
+    long long total = 0;
+    long long failed = 0;
+    const int window = BATCH_WINDOW*jobs;
+    BatchJob* batch = calloc(window, sizeof(BatchJob));
+    BatchWorker* workers = calloc(jobs, sizeof(BatchWorker));
+    int at_end = 0;
+    while (!at_end) {
+        int num_jobs = 0;
+        while (num_jobs < window && batch_read_line(in, batch[num_jobs].expr)) {
+            num_jobs++;
+        }
+        at_end = num_jobs < window;
+        // one at a time, since some expressions take far longer than others
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(jobs)
+        for (int i = 0; i < num_jobs; i++) {
+#ifdef _OPENMP
+            BatchWorker* worker = &workers[omp_get_thread_num()];
+#else
+            BatchWorker* worker = &workers[0];
+#endif
+            batch_run(&batch[i], worker);
+        }
+        for (int i = 0; i < num_jobs; i++) {
+            failed += batch_print(&batch[i]);
+        }
+        total += num_jobs;
+    }
+    fflush(stdout);
+    for (int i = 0; i < window; i++) {
+        free(batch[i].out);
+    }
+    free(batch);
+    for (int i = 0; i < jobs; i++) {
+        if (workers[i].buf != NULL) {
+            fclose(workers[i].buf);
+        }
+        dice_ctx_free(workers[i].ctx);
+    }
+    free(workers);
+    if (in != stdin) {
+        fclose(in);
+    }
+    const double elapsed = wall_seconds() - start;
+    fprintf(stderr, "%lld expressions (%lld failed) in %.3f s, %.1f per second\n",
+            total, failed, elapsed, elapsed > 0 ? total/elapsed : 0.0);
+    return failed > 0;
+}
+
+#endif
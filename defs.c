@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef DEBUG_PRINT
 uint32_t hash(char *str, const uint32_t initial) {
@@ -66,6 +68,17 @@ uint32_t _last_debug_hash = 0;
  *  - left: Value corresponding to arr[0], so if left is 5, then arr[0] is the
  *          probability that this distribution is equal to 5, arr[1] for 6, etc.
  *  - arr: Pointer to array storing the probability mass function.
+ *  - stride: Distance between the values of consecutive entries of arr, so
+ *            arr[k] is the probability of left + k*stride. Usually 1, but
+ *            1000*3d6 has stride 1000 instead of being mostly zeros.
+ * 
+ * sparse distribution: A calculated PMF that takes a few values spread far
+ * apart, like 1d6^3 (see sparse.c)
+ *  - type SPARSE
+ *  - len: The length of arr and values, at least 2
+ *  - arr: arr[k] is the probability of values[k]
+ *  - values: The values it takes, in increasing order
+ *  - left: Same as values[0]
  * 
  * function: A pre-defined function
  *  - type FUNCTION
@@ -82,6 +95,8 @@ typedef struct Token {
     int64_t len;
     int64_t left;
     int64_t right;
+    int64_t stride;
+    int64_t* values; // only for SPARSE
     char type;
 } Token;
 
@@ -116,6 +131,9 @@ typedef struct Token {
 #define FUNCTION '{'
 // Needed to make some logic work
 #define DROPPER ';'
+// Returned when something goes wrong, after printing what went wrong
+#define INVALID '?'
+#define SPARSE '}'
 
 /**
  * Returns true if the character, when input by a user, represents a binary operator,
@@ -170,7 +188,9 @@ void print_token(const Token t) {
     } else if (t.type == DICE_EXPRESSION) {
         fprintf(stderr, " %ldd%ld ", t.left, t.right);
     } else if (t.type == PMF) {
-        fprintf(stderr, " <D start:%ld,len:%ld> ", t.left, t.len);
+        fprintf(stderr, " <D start:%ld,len:%ld,stride:%ld> ", t.left, t.len, t.stride);
+    } else if (t.type == SPARSE) {
+        fprintf(stderr, " <S start:%ld,len:%ld> ", t.left, t.len);
     } else if (t.type == CONSTANT) {
         fprintf(stderr, " %ld ", t.left);
     } else if (t.type == FUNCTION) {
@@ -187,7 +207,9 @@ void debug_print_token(const Token t) {
     } else if (t.type == DICE_EXPRESSION) {
         fprintf(stderr, " %ldd%ld ", t.left, t.right);
     } else if (t.type == PMF) {
-        fprintf(stderr, " <D start:%ld,len:%ld> ", t.left, t.len);
+        fprintf(stderr, " <D start:%ld,len:%ld,stride:%ld> ", t.left, t.len, t.stride);
+    } else if (t.type == SPARSE) {
+        fprintf(stderr, " <S start:%ld,len:%ld> ", t.left, t.len);
     } else if (t.type == CONSTANT) {
         fprintf(stderr, " %ld ", t.left);
     } else if (t.type == FUNCTION) {
@@ -200,18 +222,48 @@ void debug_print_token(const Token t) {
     #endif
 }
 
-int exit_flag = 0; // If true, say something when exiting.
 /**
- * Function to exit in case of error that could cause memory leak (most of them)
+ * Makes a token of type INVALID. Anything that returns a token returns one of
+ * these when it can't do what it was asked, after printing why and freeing its
+ * arguments, so that the caller can give up without leaking anything.
+ */
+Token invalid_token() {
+    Token t;
+    t.type = INVALID;
+    t.arr = NULL;
+    t.left = t.right = 0;
+    t.len = 0;
+    t.stride = 1;
+    t.values = NULL;
+    return t;
+}
+
+/**
+ * Frees t's arrays, if it has any.
  */
-void Exit(int n) {
-    if (exit_flag) {
-        fprintf(stderr, "Irrecoverable error. Exiting.\n");
-        #ifdef _WIN32
-        system("pause");
-        #endif
+void free_token(const Token t) {
+    if (t.type == PMF || t.type == SPARSE) {
+        free(t.arr);
+    }
+    if (t.type == SPARSE) {
+        free(t.values);
     }
-    exit(n);
+}
+
+/**
+ * \return A copy of t with its own arrays
+ */
+Token copy_token(const Token t) {
+    Token out = t;
+    if (t.type == PMF || t.type == SPARSE) {
+        out.arr = malloc(t.len*sizeof(double));
+        memcpy(out.arr, t.arr, t.len*sizeof(double));
+    }
+    if (t.type == SPARSE) {
+        out.values = malloc(t.len*sizeof(int64_t));
+        memcpy(out.values, t.values, t.len*sizeof(int64_t));
+    }
+    return out;
 }
 
 // Arbitrary constant limiting how many tokens the user can input at a time.
@@ -223,21 +275,63 @@ void Exit(int n) {
 // I figured that 128 is high enough that it won't be a problem.
 #define TOKEN_LEN 128
 
-// Buffer where tokens are placed during parsing.
-Token TOKEN_BUF[MAX_TOKENS*2];
-// Buffer where strings are placed during parsing.
-char PARSE_BUF[MAX_TOKENS][TOKEN_LEN];
-// Buffer where the user's input is placed.
-char INPUT_BUF[4096];
+// Most parentheses the user can nest
+#define PAREN_STACK_SIZE 1024
+// Size of the buffer for the canonical text of subexpressions, see
+// hash_subexpressions in pemdas.c
+#define EXPR_TEXT_BUF_LEN (256*1024)
+
+// Thread-local variables. C99 doesn't have them, but gcc and clang do.
+#define THREAD_LOCAL __thread
+
+struct ExprMemo; // pemdas.c
+struct PlanCache; // array_math.c
+
+/**
+ * Everything that changes while evaluating an expression. Different threads
+ * can evaluate at the same time as long as they're in different contexts.
+ * All the code works in whichever context CTX points to, which is
+ * default_context unless dice_eval (in dice.c) says otherwise.
+ */
+typedef struct DiceContext {
+    // Buffer where tokens are placed during parsing.
+    Token token_buf[MAX_TOKENS*2];
+    // Buffer where strings are placed during parsing.
+    char parse_buf[MAX_TOKENS][TOKEN_LEN];
+    // Buffer where the user's input is placed.
+    char input_buf[4096];
+    // Stack used by reformat_functions in parse.c
+    int paren_stack[PAREN_STACK_SIZE];
+    int paren_stack_i;
+    Token stack[128]; // RPN stack
+    Token queue[128]; // Queue used to convert to RPN
+    // Total probability T_prune has thrown away
+    double pruned_mass;
+    char expr_text_buf[EXPR_TEXT_BUF_LEN];
+    // These are made when they're first needed
+    struct ExprMemo* expr_memo;
+    struct PlanCache* plan_cache;
+    // Contexts the other threads work in when parts of an expression are
+    // worked out in parallel (see reverse_polish_parallel in pemdas.c),
+    // indexed by OpenMP thread number
+    struct DiceContext** workers;
+    int num_workers;
+    // Where results and error messages go. NULL means stdout and stderr.
+    // Batch mode points them at a buffer for each expression.
+    FILE* out;
+    FILE* err;
+} DiceContext;
+
+DiceContext default_context;
+THREAD_LOCAL DiceContext* CTX = &default_context;
+
+#define TOKEN_BUF (CTX->token_buf)
+#define PARSE_BUF (CTX->parse_buf)
+#define INPUT_BUF (CTX->input_buf)
+#define OUT_STREAM (CTX->out != NULL ? CTX->out : stdout)
+#define ERR_STREAM (CTX->err != NULL ? CTX->err : stderr)
 
 // plotting
-// Length of string buffer used in plotting. Limits the length of each row in
-// the ASCII art plot.
-#define PLOT_BUF_LEN 1024
-// Buffer used in plotting that contains rows prior to being sent to printf
-char PLOT_BUF[PLOT_BUF_LEN];
-// Buffer used in plotting.
-double DATA_BUF[PLOT_BUF_LEN];
 // Number of columns to the left of the plot area
 #define LEFT_OFFSET 1
 // Number of columns to the right of the plot area
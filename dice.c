@@ -0,0 +1,94 @@
+#ifndef DICE_C
+#define DICE_C
+
+#include <stdlib.h>
+#include <string.h>
+#include "dice.h"
+#include "defs.c"
+#include "parse.c"
+#include "pemdas.c"
+
+// This file implements the library interface in dice.h. The command line
+// program includes it too, and does everything in default_context.
+
+void dice_init() {
+    init_conv_crossover();
+    init_exact_mode();
+    init_prune_budget();
+    init_drop_cache();
+    init_result_cache();
+    init_ntt_primes();
+}
+
+dice_ctx* dice_ctx_new() {
+    return calloc(1, sizeof(DiceContext));
+}
+
+void dice_ctx_free(dice_ctx* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->expr_memo != NULL) {
+        clear_expr_memo(ctx->expr_memo);
+        free(ctx->expr_memo);
+    }
+    if (ctx->plan_cache != NULL) {
+        clear_rfft_plan_cache(ctx->plan_cache);
+        free(ctx->plan_cache);
+    }
+    for (int i = 0; i < ctx->num_workers; i++) {
+        dice_ctx_free(ctx->workers[i]);
+    }
+    free(ctx->workers);
+    free(ctx);
+}
+
+dice_pmf* dice_eval(dice_ctx* ctx, const char* expr) {
+    // reformat_functions can make the input up to twice as long
+    if (strlen(expr) >= sizeof(ctx->input_buf)/2) {
+        return NULL;
+    }
+    DiceContext* const old = CTX;
+    CTX = ctx;
+    char const *fake_argv[2] = {NULL, expr};
+    dice_pmf* out = NULL;
+    const int n = parse_token_main(2, fake_argv);
+    Token t = invalid_token();
+    if (n != -1) {
+        ctx->pruned_mass = 0.0;
+        t = pemdas(TOKEN_BUF, n);
+    }
+    if (t.type != INVALID) {
+        out = malloc(sizeof(dice_pmf));
+        out->values = NULL;
+        if (t.type == CONSTANT) {
+            out->pmf = malloc(sizeof(double));
+            out->pmf[0] = 1.0;
+            out->len = 1;
+            out->stride = 1;
+        } else {
+            out->pmf = t.arr;
+            out->len = t.len;
+            out->stride = t.stride;
+        }
+        if (t.type == SPARSE) {
+            out->values = t.values;
+            out->stride = 0;
+        }
+        out->left = t.left;
+        out->pruned = ctx->pruned_mass;
+    }
+    CTX = old;
+    return out;
+}
+
+void dice_pmf_free(dice_pmf* pmf) {
+    if (pmf == NULL) {
+        return;
+    }
+    free(pmf->pmf);
+    free(pmf->values);
+    free(pmf);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef DICE_H
+#define DICE_H
+
+#include <stdint.h>
+
+// Interface for using the dice calculator as a library (libdice.a, see
+// make.sh). Each thread should evaluate in its own context. Evaluations in
+// different contexts don't share any state, except for caches of finished
+// results (see DICE_DROP_SNAPSHOT and DICE_RESULT_CACHE in the README), which
+// are safe to share.
+//
+//     dice_init();
+//     dice_ctx* ctx = dice_ctx_new();
+//     dice_pmf* pmf = dice_eval(ctx, "4d6kh3");
+//     ... pmf->pmf[k] is the probability of pmf->left + k*pmf->stride ...
+//     dice_pmf_free(pmf);
+//     dice_ctx_free(ctx);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DiceContext dice_ctx;
+
+// A finished distribution. pmf[k] is the probability of left + k*stride,
+// unless values isn't NULL. Then it's sparse (like 1d6^3, which takes 6 values
+// between 1 and 216), stride is 0, and pmf[k] is the probability of values[k].
+typedef struct dice_pmf {
+    double* pmf;
+    int64_t* values;
+    int64_t left;
+    int64_t len;
+    int64_t stride;
+    // Probability cut off the tails while working it out, see DICE_PRUNE
+    double pruned;
+} dice_pmf;
+
+// Reads the settings from the environment (DICE_EXACT, DICE_PRUNE, etc, see
+// the README) and sets up the tables and caches shared by every context. Call
+// this once, before anything else and before starting any threads.
+void dice_init(void);
+
+// Makes a new context. Free it with dice_ctx_free.
+dice_ctx* dice_ctx_new(void);
+void dice_ctx_free(dice_ctx* ctx);
+
+// Works out the distribution of expr, like "4d6*(3d6+2)". Returns NULL if
+// expr isn't valid or can't be worked out (like "1d6/0"), after printing why
+// to stderr. The context is still good to use after that. Free the result with
+// dice_pmf_free.
+dice_pmf* dice_eval(dice_ctx* ctx, const char* expr);
+void dice_pmf_free(dice_pmf* pmf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
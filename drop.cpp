@@ -28,74 +28,747 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <tuple>
 #include <map>
+#include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
 #include "drop.h"
 
 #define min(x,y) (((x) > (y)) ? (y) : (x))
+#define max(x,y) (((x) > (y)) ? (x) : (y))
 
-const size_t memory_limit = 4LL*1024*1024*1024/sizeof(double);
+// Default memory budget for cached solutions. Can be changed with the
+// environment variable DICE_DROP_CACHE_MB.
+const size_t default_cache_budget = 256LL*1024*1024;
 
-using std::tuple;
 using std::map;
 
-typedef struct Arr {
-    int len;
-    double* array;
-} Arr;
-
-typedef tuple<int,int,int> Triplet;
-map<Triplet,Arr> cache_map;
-size_t total_memory = 0;
-size_t wasted_memory = 0;
-
-Arr solve(const int faces, const int n, const int keep) {
-    //printf("read  %d %d %d\n", faces, n, keep);
-    // TODO: Try using a hash table instead of array.
-    // Memory usage might be rough.
-    map<Triplet,Arr>::iterator i = cache_map.find(Triplet(faces,n,keep));
-    if (i != cache_map.end()) {
-        return i->second;
-    }
-    int state;
-    const int outlen = n*faces+1;
-    Arr out;
-    out.len = outlen;
-    total_memory += outlen;
-    if (total_memory >= memory_limit) {
-        fprintf(stderr, "Current memory usage: %zd MB. Exiting to not use all your memory.\n",
-                total_memory*sizeof(double)/(1024*1024)
-        );
-        exit(1);
-    }
-    out.array = (double*)calloc(outlen, sizeof(double));
-    if (faces == 1) { // do this before the function call
-        // From tests on reasonably large inputs, this contributes a tiny
-        // fraction (0.7% or less) of our memory usage, so it isn't worth
-        // trying to optimize this.
-        // wasted_memory += outlen;;
-        state = faces * min(n, keep);
-        out.array[state] = 1.0;
+// (0, faces, n, keep) for n identical dice, or (1, keep, then each kind of
+// die in the pool) for pools, see solve_pool.
+typedef std::vector<double> CacheKey;
+// A solution is shared between the cache and whoever asked for it, so that
+// evicting it can't pull the array out from under the caller.
+typedef std::shared_ptr<std::vector<double> > Solution;
+
+/**
+ * Cache of solutions to previous queries. Holds at most budget bytes of
+ * arrays (keys included); least recently used entries are evicted to make
+ * room. Safe to use from several threads.
+ */
+class DropCache {
+public:
+    DropCache() : budget(default_cache_budget), bytes(0), hits(0), misses(0),
+                  evictions(0) {}
+
+    /**
+     * \return The cached solution for key, or an empty pointer.
+     */
+    Solution find(const CacheKey& key) {
+        std::lock_guard<std::mutex> guard(lock);
+        map<CacheKey,Entry>::iterator i = entries.find(key);
+        if (i == entries.end()) {
+            misses++;
+            return Solution();
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, i->second.lru);
+        return i->second.value;
+    }
+
+    /**
+     * Adds a solution, evicting old ones if needed. Solutions bigger than
+     * the whole budget aren't cached.
+     */
+    void insert(const CacheKey& key, const Solution& value) {
+        std::lock_guard<std::mutex> guard(lock);
+        const size_t size = entry_size(key, value);
+        if (size > budget || entries.count(key)) {
+            return;
+        }
+        evict_until(budget - size);
+        lru.push_front(key);
+        Entry entry = {value, lru.begin()};
+        entries[key] = entry;
+        bytes += size;
+    }
+
+    void set_budget(const size_t new_budget) {
+        std::lock_guard<std::mutex> guard(lock);
+        budget = new_budget;
+        evict_until(budget);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        evictions += entries.size();
+        entries.clear();
+        lru.clear();
+        bytes = 0;
+    }
+
+    DropCacheStats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        DropCacheStats out;
+        out.hits = hits;
+        out.misses = misses;
+        out.evictions = evictions;
+        out.entries = entries.size();
+        out.bytes = bytes;
+        out.budget = budget;
+        out.snapshot_hits = 0;
+        out.snapshot_entries = 0;
         return out;
     }
-    double binom_exp = 1.0;
-    for (int k = 0; k < n+1; k++) {
-        int mkk = min(keep, k);
-        Arr tail = solve(faces-1, n-k, keep-mkk);
-        for (int i = 0; i < tail.len; i++) {
-            state = i + faces * mkk;
-            double weight = tail.array[i];
-            weight *= binom_exp;
-            out.array[state] += weight;
+
+private:
+    struct Entry {
+        Solution value;
+        std::list<CacheKey>::iterator lru;
+    };
+
+    static size_t entry_size(const CacheKey& key, const Solution& value) {
+        return (key.size() + value->size())*sizeof(double);
+    }
+
+    // Evicts least recently used entries until we use at most target bytes.
+    // Caller must hold the lock.
+    void evict_until(const size_t target) {
+        while (bytes > target && !lru.empty()) {
+            map<CacheKey,Entry>::iterator i = entries.find(lru.back());
+            bytes -= entry_size(i->first, i->second.value);
+            entries.erase(i);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+
+    map<CacheKey,Entry> entries;
+    std::list<CacheKey> lru; // front is most recently used
+    size_t budget;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    std::mutex lock;
+};
+
+DropCache cache;
+
+// Snapshot files let separate runs of the program share solutions. Layout, in
+// native byte order:
+//   header: the 8 bytes "DICEDROP", uint32 version, uint32 sizeof(double)
+//   records until the end of the file: uint64 key length, uint64 value
+//   length, then the key and the value as arrays of doubles
+// Records are only ever appended, each with a single write to an O_APPEND file
+// while holding an exclusive flock, so other processes never see half a
+// record and the worst a crash can do is leave a truncated last record, which
+// we ignore. (No flock on Windows, so don't share it between processes there.)
+const char snapshot_magic[8] = {'D', 'I', 'C', 'E', 'D', 'R', 'O', 'P'};
+const uint32_t snapshot_version = 1;
+
+/**
+ * Read-only view of a snapshot file, plus a handle for appending new
+ * solutions to it. Safe to use from several threads.
+ */
+class DropSnapshot {
+public:
+    DropSnapshot() : data(NULL), size(0), fd(-1), hits(0) {}
+
+    ~DropSnapshot() {
+        close();
+    }
+
+    /**
+     * Opens (or creates) the snapshot at path. Prints a warning and leaves
+     * the snapshot disabled if the file isn't usable.
+     */
+    void open(const char* path) {
+        std::lock_guard<std::mutex> guard(lock);
+#ifdef _WIN32
+        fd = ::_open(path, _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY,
+                      _S_IREAD | _S_IWRITE);
+#else
+        fd = ::open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+#endif
+        if (fd == -1) {
+            fprintf(stderr, "Can't open drop snapshot \"%s\", ignoring it\n", path);
+            return;
+        }
+        lock_file(LOCK_EX);
+        bool ok = true;
+        if (file_size() == 0) {
+            char header[sizeof(snapshot_magic) + 2*sizeof(uint32_t)];
+            const uint32_t versions[2] = {snapshot_version, (uint32_t)sizeof(double)};
+            memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+            memcpy(header + sizeof(snapshot_magic), versions, sizeof(versions));
+            ok = write_all(header, sizeof(header));
+        }
+        // Downgrade so other processes can read while we index
+        lock_file(LOCK_SH);
+        ok = ok && map_file() && read_index();
+        lock_file(LOCK_UN);
+        if (!ok) {
+            fprintf(stderr, "\"%s\" isn't a drop snapshot from this version, "
+                    "ignoring it\n", path);
+            unmap_file();
+            close_file();
+        }
+    }
+
+    /**
+     * \return The solution for key stored in the file, or an empty pointer.
+     */
+    Solution find(const CacheKey& key) {
+        std::lock_guard<std::mutex> guard(lock);
+        map<CacheKey,Record>::iterator i = index.find(key);
+        if (i == index.end() || i->second.value == NULL) {
+            return Solution();
+        }
+        hits++;
+        const double* value = i->second.value;
+        return std::make_shared<std::vector<double> >(
+            value, value + i->second.len
+        );
+    }
+
+    /**
+     * Appends a solution to the file, unless it's already there.
+     */
+    void append(const CacheKey& key, const Solution& value) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd == -1 || index.count(key)) {
+            return;
+        }
+        // Build the whole record first so it goes out in one write.
+        std::vector<double> record(2 + key.size() + value->size());
+        const uint64_t lens[2] = {key.size(), value->size()};
+        memcpy(record.data(), lens, sizeof(lens));
+        std::copy(key.begin(), key.end(), record.begin() + 2);
+        std::copy(value->begin(), value->end(), record.begin() + 2 + key.size());
+        lock_file(LOCK_EX);
+        const bool ok = write_all(record.data(), record.size()*sizeof(double));
+        lock_file(LOCK_UN);
+        if (ok) {
+            // Nothing to point at in our mapping, but we know it's written.
+            Record written = {NULL, 0};
+            index[key] = written;
+        }
+    }
+
+    uint64_t num_hits() {
+        std::lock_guard<std::mutex> guard(lock);
+        return hits;
+    }
+
+    size_t num_entries() {
+        std::lock_guard<std::mutex> guard(lock);
+        return index.size();
+    }
+
+private:
+    struct Record {
+        const double* value; // points into data, or NULL if we wrote it
+        uint64_t len;
+    };
+
+#ifdef _WIN32
+    enum {LOCK_SH, LOCK_EX, LOCK_UN};
+    void lock_file(int) {}
+
+    int64_t file_size() {
+        return ::_lseeki64(fd, 0, SEEK_END);
+    }
+
+    bool write_all(const void* buf, size_t len) {
+        return ::_write(fd, buf, len) == (int)len;
+    }
+
+    void close_file() {
+        if (fd != -1) {
+            ::_close(fd);
+            fd = -1;
+        }
+    }
+
+    bool map_file() {
+        // No mmap here, so just read the whole thing in.
+        const int64_t len = file_size();
+        if (len <= 0 || ::_lseeki64(fd, 0, SEEK_SET) != 0) {
+            return false;
+        }
+        size = len;
+        data = (const char*)malloc(size);
+        return ::_read(fd, (void*)data, size) == (int)size;
+    }
+#else
+    void lock_file(int op) {
+        flock(fd, op);
+    }
+
+    int64_t file_size() {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            return -1;
+        }
+        return st.st_size;
+    }
+
+    bool write_all(const void* buf, size_t len) {
+        return ::write(fd, buf, len) == (ssize_t)len;
+    }
+
+    void close_file() {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    bool map_file() {
+        const int64_t len = file_size();
+        if (len <= 0) {
+            return false;
+        }
+        size = len;
+        void* mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            data = NULL;
+            return false;
+        }
+        data = (const char*)mem;
+        return true;
+    }
+#endif
+
+    void unmap_file() {
+        if (data == NULL) {
+            return;
+        }
+#ifdef _WIN32
+        free((void*)data);
+#else
+        munmap((void*)data, size);
+#endif
+        data = NULL;
+    }
+
+    // Checks the header and indexes every complete record.
+    bool read_index() {
+        const size_t header_size = sizeof(snapshot_magic) + 2*sizeof(uint32_t);
+        uint32_t header[2];
+        if (size < header_size || memcmp(data, snapshot_magic, sizeof(snapshot_magic))) {
+            return false;
+        }
+        memcpy(header, data + sizeof(snapshot_magic), sizeof(header));
+        if (header[0] != snapshot_version || header[1] != sizeof(double)) {
+            return false;
+        }
+        size_t pos = header_size;
+        while (pos + 2*sizeof(uint64_t) <= size) {
+            uint64_t lens[2];
+            memcpy(lens, data + pos, sizeof(lens));
+            pos += sizeof(lens);
+            // Checked one at a time so garbage lengths can't overflow
+            const uint64_t rest = (size - pos)/sizeof(double);
+            if (lens[0] == 0 || lens[0] > rest || lens[1] > rest - lens[0]) {
+                break; // garbage or truncated, ignore the rest
+            }
+            const double* key = (const double*)(data + pos);
+            Record record = {key + lens[0], lens[1]};
+            index[CacheKey(key, key + lens[0])] = record;
+            pos += (lens[0] + lens[1])*sizeof(double);
+        }
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        unmap_file();
+        close_file();
+    }
+
+    map<CacheKey,Record> index;
+    const char* data;
+    size_t size;
+    int fd; // for appending
+    uint64_t hits;
+    std::mutex lock;
+};
+
+DropSnapshot snapshot;
+
+/**
+ * Looks for a solution in the cache, then in the snapshot file.
+ *
+ * \return The solution for key, or an empty pointer.
+ */
+Solution find_solution(const CacheKey& key) {
+    Solution out = cache.find(key);
+    if (!out) {
+        out = snapshot.find(key);
+        if (out) {
+            cache.insert(key, out);
         }
-        binom_exp *= n-k;
-        binom_exp /= k+1;
     }
-    cache_map[Triplet(faces,n,keep)] = out;
     return out;
 }
 
+/**
+ * Saves a newly computed solution to the cache and the snapshot file.
+ */
+void save_solution(const CacheKey& key, const Solution& value) {
+    cache.insert(key, value);
+    snapshot.append(key, value);
+}
+
+// The DP goes through the faces from lowest to highest. Layer f holds, for
+// every number of dice m that could be left once we get down to face f, the
+// distribution of the sum of the kept dice among those m dice (each showing
+// 1..f). How many of them we keep only depends on m, since the dice showing
+// faces above f were kept first. Layer f only depends on layer f-1, so we only
+// ever hold two layers, each in one contiguous slab.
+typedef struct Layer {
+    int faces;
+    int n; // states are m = 0..n dice left
+    // State m is slab[offsets[m]] to slab[offsets[m+1]-1]. The slab holds
+    // about n*keep*faces/2 entries, which can be more than an int counts.
+    int64_t* offsets;
+    double* slab;
+} Layer;
+
+/**
+ * Number of dice we keep out of the m lowest, when keeping the highest keep
+ * out of n total.
+ */
+static inline int kept(const int n, const int keep, const int m) {
+    return max(0, keep-(n-m));
+}
+
+/**
+ * Allocates a zeroed layer. State m needs room for sums 0..kept*faces.
+ */
+Layer make_layer(const int faces, const int n, const int keep) {
+    Layer out;
+    out.faces = faces;
+    out.n = n;
+    out.offsets = (int64_t*)malloc((n+2)*sizeof(int64_t));
+    out.offsets[0] = 0;
+    for (int m = 0; m <= n; m++) {
+        out.offsets[m+1] = out.offsets[m] + (int64_t)kept(n, keep, m)*faces + 1;
+    }
+    out.slab = (double*)calloc(out.offsets[n+1], sizeof(double));
+    return out;
+}
+
+void free_layer(Layer* layer) {
+    free(layer->offsets);
+    free(layer->slab);
+    layer->offsets = NULL;
+    layer->slab = NULL;
+}
+
+/**
+ * Builds layer f from layer f-1. If m dice are left and k of them show f
+ * (probability binom(m, k) (1/f)^k ((f-1)/f)^(m-k)), we keep min(kept, k) of
+ * those, adding f for each, and the other m-k dice come from layer f-1.
+ *
+ * \param[in] prev Layer f-1
+ * \param[in,out] cur Layer f, zeroed
+ * \param keep Number of dice kept out of all n
+ * \param[in] log_fact log_fact[i] = log(i!)
+ */
+void fill_layer(const Layer* prev, Layer* cur, const int keep, const double* log_fact) {
+    const int f = cur->faces;
+    const int n = cur->n;
+    const double log_p = log(1.0/f);
+    const double log_q = log1p(-1.0/f);
+    // Every state only reads from prev and writes to its own part of the
+    // slab, so the states of a layer can be done in parallel. Bigger m means
+    // more work, hence the dynamic schedule.
+    #pragma omp parallel for schedule(dynamic) if (n >= 16)
+    for (int m = 0; m <= n; m++) {
+        const int keep_m = kept(n, keep, m);
+        double* out = cur->slab + cur->offsets[m];
+        for (int k = 0; k <= m; k++) {
+            const int mkk = min(keep_m, k);
+            const double weight = exp(log_fact[m] - log_fact[k] - log_fact[m-k]
+                                      + k*log_p + (m-k)*log_q);
+            const double* tail = prev->slab + prev->offsets[m-k];
+            const int64_t tail_len = prev->offsets[m-k+1] - prev->offsets[m-k];
+            double* dest = out + (int64_t)f*mkk;
+            #pragma omp simd
+            for (int64_t i = 0; i < tail_len; i++) {
+                dest[i] += weight*tail[i];
+            }
+        }
+    }
+}
+
+/**
+ * Finds the distribution of the sum of the highest keep of n faces-sided dice.
+ *
+ * \return Solution where (*solution)[s] is the probability that the sum is s
+ */
+Solution solve(const int faces, const int n, int keep) {
+    keep = min(keep, n);
+    CacheKey key(4);
+    key[0] = 0;
+    key[1] = faces;
+    key[2] = n;
+    key[3] = keep;
+    Solution cached = find_solution(key);
+    if (cached) {
+        return cached;
+    }
+    double* log_fact = (double*)malloc((n+1)*sizeof(double));
+    log_fact[0] = 0.0;
+    for (int m = 1; m <= n; m++) {
+        log_fact[m] = log_fact[m-1] + log((double)m);
+    }
+    // With one face, every die shows 1.
+    Layer prev = make_layer(1, n, keep);
+    for (int m = 0; m <= n; m++) {
+        prev.slab[prev.offsets[m] + min(m, kept(n, keep, m))] = 1.0;
+    }
+    for (int f = 2; f <= faces; f++) {
+        Layer cur = make_layer(f, n, keep);
+        fill_layer(&prev, &cur, keep, log_fact);
+        free_layer(&prev);
+        prev = cur;
+    }
+    free(log_fact);
+    const double* top = prev.slab + prev.offsets[n];
+    Solution out = std::make_shared<std::vector<double> >(
+        top, top + (prev.offsets[n+1] - prev.offsets[n])
+    );
+    free_layer(&prev);
+    save_solution(key, out);
+    return out;
+}
+
+// One kind of die in a pool: count copies of a die whose PMF is pmf, where
+// pmf[0] is the probability of rolling left.
+typedef struct PoolDie {
+    const double* pmf;
+    int64_t left;
+    int64_t len;
+    int count;
+} PoolDie;
+
+static inline double pool_die_at(const PoolDie& die, const int64_t x) {
+    if (x < die.left || x >= die.left + die.len) {
+        return 0.0;
+    }
+    return die.pmf[x - die.left];
+}
+
+/**
+ * Finds the distribution of the sum of the highest keep dice out of a pool of
+ * several kinds of dice, each with an arbitrary PMF.
+ *
+ * Same idea as solve, but the state is now how many dice of each kind are left
+ * (one dimension per kind of die), and we go through the outcomes
+ * lo..hi of all the dice instead of the faces 1..f. Layer o holds, for each
+ * state, the probability that all of those dice are <= o and that the kept
+ * ones add up to each sum. Sums are stored relative to keep*lo.
+ *
+ * \param dice The kinds of dice in the pool
+ * \param keep Number of dice to keep, at most the size of the pool
+ * \param lo Lowest outcome of any die
+ * \param hi Highest outcome of any die
+ * \return Solution where (*solution)[s] is the probability that the sum is
+ * s + keep*lo
+ */
+Solution solve_pool(const std::vector<PoolDie>& dice, const int keep,
+                    const int64_t lo, const int64_t hi) {
+    const int types = (int)dice.size();
+    CacheKey key;
+    key.push_back(1);
+    key.push_back(keep);
+    for (int t = 0; t < types; t++) {
+        key.push_back(dice[t].count);
+        key.push_back((double)dice[t].left);
+        key.push_back((double)dice[t].len);
+        key.insert(key.end(), dice[t].pmf, dice[t].pmf + dice[t].len);
+    }
+    Solution cached = find_solution(key);
+    if (cached) {
+        return cached;
+    }
+    // States are numbered in mixed radix, digit t being how many dice of kind
+    // t are left. Taking k dice out of state m is then just m-k, as long as
+    // every digit of k is at most the matching digit of m.
+    int n = 0;
+    int num_states = 1;
+    std::vector<int> radix(types);
+    std::vector<int> place(types); // what one die of kind t adds to a state
+    for (int t = 0; t < types; t++) {
+        n += dice[t].count;
+        radix[t] = dice[t].count + 1;
+        place[t] = num_states;
+        num_states *= radix[t];
+    }
+    std::vector<std::vector<int> > digits(num_states, std::vector<int>(types));
+    std::vector<int> total(num_states, 0); // number of dice in each state
+    for (int s = 0; s < num_states; s++) {
+        int rest = s;
+        for (int t = 0; t < types; t++) {
+            digits[s][t] = rest % radix[t];
+            rest /= radix[t];
+            total[s] += digits[s][t];
+        }
+    }
+    double* log_fact = (double*)malloc((n+1)*sizeof(double));
+    log_fact[0] = 0.0;
+    for (int m = 1; m <= n; m++) {
+        log_fact[m] = log_fact[m-1] + log((double)m);
+    }
+    // Layer lo: every die shows lo, so the (relative) sum is 0.
+    std::vector<std::vector<double> > prev(num_states, std::vector<double>(1));
+    for (int s = 0; s < num_states; s++) {
+        double p = 1.0;
+        for (int t = 0; t < types; t++) {
+            p *= pow(pool_die_at(dice[t], lo), digits[s][t]);
+        }
+        prev[s][0] = p;
+    }
+    for (int64_t o = lo+1; o <= hi; o++) {
+        const int64_t d = o - lo;
+        // log_p[t] = log P(a die of kind t shows o)
+        std::vector<double> log_p(types);
+        for (int t = 0; t < types; t++) {
+            log_p[t] = log(pool_die_at(dice[t], o));
+        }
+        std::vector<std::vector<double> > cur(num_states);
+        #pragma omp parallel for schedule(dynamic) if (num_states >= 16)
+        for (int s = 0; s < num_states; s++) {
+            const int keep_s = kept(n, keep, total[s]);
+            std::vector<double>& out = cur[s];
+            out.assign(keep_s*d + 1, 0.0);
+            // Go through every k <= digits[s], ie every way of choosing which
+            // of the dice show o. Counting up digit by digit, like an
+            // odometer, only visits those, instead of every state.
+            const std::vector<int>& m = digits[s];
+            std::vector<int> j(types, 0); // digits of k
+            int k = 0;
+            while (true) {
+                int taken = 0;
+                double log_w = 0.0;
+                for (int t = 0; t < types; t++) {
+                    if (j[t] > 0) {
+                        log_w += log_fact[m[t]] - log_fact[j[t]]
+                                 - log_fact[m[t]-j[t]] + j[t]*log_p[t];
+                        taken += j[t];
+                    }
+                }
+                if (log_w != -INFINITY) {
+                    const double weight = exp(log_w);
+                    const std::vector<double>& tail = prev[s-k];
+                    double* dest = out.data() + d*min(keep_s, taken);
+                    const int tail_len = (int)tail.size();
+                    #pragma omp simd
+                    for (int i = 0; i < tail_len; i++) {
+                        dest[i] += weight*tail[i];
+                    }
+                }
+                int t = 0;
+                while (t < types && j[t] == m[t]) {
+                    k -= j[t]*place[t];
+                    j[t] = 0;
+                    t++;
+                }
+                if (t == types) {
+                    break;
+                }
+                j[t]++;
+                k += place[t];
+            }
+        }
+        prev.swap(cur);
+    }
+    free(log_fact);
+    Solution out = std::make_shared<std::vector<double> >(prev[num_states-1]);
+    save_solution(key, out);
+    return out;
+}
+
+void init_drop_cache() {
+    const char* path = getenv("DICE_DROP_SNAPSHOT");
+    if (path != NULL && *path != '\0') {
+        snapshot.open(path);
+    }
+    const char* env = getenv("DICE_DROP_CACHE_MB");
+    if (env == NULL) {
+        return;
+    }
+    char* end;
+    long long val = strtoll(env, &end, 10);
+    if (end != env && *end == '\0' && val >= 0) {
+        cache.set_budget((size_t)val*1024*1024);
+    }
+}
+
+void drop_cache_set_budget(const size_t bytes) {
+    cache.set_budget(bytes);
+}
+
+void drop_cache_clear() {
+    cache.clear();
+}
+
+void drop_cache_stats(DropCacheStats* out) {
+    *out = cache.stats();
+    out->snapshot_hits = snapshot.num_hits();
+    out->snapshot_entries = snapshot.num_entries();
+}
+
+/**
+ * Copies the part of a solution between the first and last nonzero entries,
+ * normalized to add up to 1. My other code will eventually free the output,
+ * so it needs to be a copy.
+ *
+ * \param solution Solution to copy
+ * \param[out] firstptr Index of the first nonzero entry of solution
+ * \param[out] lenptr Length of the output
+ */
+double* trimmed_copy(const std::vector<double>& solution, int64_t* firstptr,
+                     int64_t* lenptr) {
+    const double* array = solution.data();
+    int64_t first = 0;
+    int64_t last = solution.size()-1;
+    while (array[first] == 0.0) {
+        first++;
+    }
+    while (array[last] == 0.0) {
+        last--;
+    }
+    const int64_t len = last - first + 1;
+    double* arr = (double*)malloc(len*sizeof(double));
+    memcpy(arr, array+first, len*sizeof(double));
+    double sum = 0.0;
+    for (int64_t i = 0; i < len; i++) {
+        sum += arr[i];
+    }
+    for (int64_t i = 0; i < len; i++) {
+        arr[i] /= sum;
+    }
+    *firstptr = first;
+    *lenptr = len;
+    return arr;
+}
+
 // I guess we want to copy the output, even though that wastes memory,
 // because it's easier than 
 // How do we handle free? It would be a pain if we freed the output,
@@ -106,35 +779,63 @@ double* drop(const int faces, const int n, int keep, int64_t* leftptr, int64_t*
         backwards = 1;
         keep = -keep;
     }
-    Arr solution = solve(faces, n, keep);
-    double* arr;
-    int64_t left = 0;
+    Solution solution = solve(faces, n, keep);
+    int64_t left;
     int64_t len;
-    int64_t last = solution.len-1;
-    while (solution.array[left] == 0.0) {
-        left++;
+    double* arr = trimmed_copy(*solution, &left, &len);
+    if (backwards) {
+        std::reverse(arr, arr+len);
     }
-    while (solution.array[last] == 0.0) {
-        last--;
+    *leftptr = left;
+    *lenptr = len;
+    return arr;
+}
+
+double* drop_pool(const int types, const double* const* pmfs,
+                  const int64_t* lefts, const int64_t* lens, const int* counts,
+                  int keep, int64_t* leftptr, int64_t* lenptr) {
+    // Keeping the lowest is keeping the highest of the negated dice, so we
+    // flip every die here and flip the answer back at the end.
+    int backwards = 0;
+    if (keep < 0) {
+        backwards = 1;
+        keep = -keep;
     }
-    len = last - left + 1;
-    arr = (double*)malloc(len*sizeof(double));
-    // My other code will eventually free arr, so it needs to be a copy.
-    memcpy(arr, solution.array+left, len*sizeof(double));
-    if (backwards) {
-        double temp;
-        for (int i = 0; i < len/2; i++) {
-            temp = arr[i];
-            arr[i] = arr[len-1-i];
-            arr[len-1-i] = temp;
+    std::vector<std::vector<double> > flipped;
+    std::vector<PoolDie> dice;
+    int n = 0;
+    for (int t = 0; t < types; t++) {
+        if (counts[t] == 0) {
+            continue;
         }
+        PoolDie die = {pmfs[t], lefts[t], lens[t], counts[t]};
+        if (backwards) {
+            flipped.push_back(std::vector<double>(pmfs[t], pmfs[t]+lens[t]));
+            std::reverse(flipped.back().begin(), flipped.back().end());
+            die.left = -(lefts[t] + lens[t] - 1);
+        }
+        dice.push_back(die);
+        n += counts[t];
     }
-    double sum = 0.0;
-    for (int i = 0; i < len; i++) {
-        sum += arr[i];
+    // The pointers into flipped are only safe once it's done growing.
+    for (size_t t = 0; backwards && t < dice.size(); t++) {
+        dice[t].pmf = flipped[t].data();
     }
-    for (int i = 0; i < len; i++) {
-        arr[i] /= sum;
+    keep = min(keep, n);
+    int64_t lo = dice[0].left;
+    int64_t hi = dice[0].left + dice[0].len - 1;
+    for (size_t t = 1; t < dice.size(); t++) {
+        lo = min(lo, dice[t].left);
+        hi = max(hi, dice[t].left + dice[t].len - 1);
+    }
+    Solution solution = solve_pool(dice, keep, lo, hi);
+    int64_t first;
+    int64_t len;
+    double* arr = trimmed_copy(*solution, &first, &len);
+    int64_t left = first + keep*lo;
+    if (backwards) {
+        std::reverse(arr, arr+len);
+        left = -(left + len - 1);
     }
     *leftptr = left;
     *lenptr = len;
@@ -1,12 +1,40 @@
 #ifndef DROP_H
 #define DROP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 double* drop(const int faces, const int n, const int keep, int64_t* leftptr, int64_t* lenptr);
 
+// Keeps the highest keep (or lowest -keep) dice out of a pool with counts[t]
+// dice of each kind t, where die t has PMF pmfs[t] of length lens[t] starting
+// at lefts[t]. At least one count must be positive.
+double* drop_pool(const int types, const double* const* pmfs,
+                  const int64_t* lefts, const int64_t* lens, const int* counts,
+                  int keep, int64_t* leftptr, int64_t* lenptr);
+
+// Statistics about the cache of drop/keep solutions
+typedef struct DropCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint64_t snapshot_hits; // cache misses found in the snapshot file
+    size_t snapshot_entries;
+} DropCacheStats;
+
+// Reads the cache budget from the environment variable DICE_DROP_CACHE_MB, and
+// opens the snapshot file named by DICE_DROP_SNAPSHOT, if any
+void init_drop_cache(void);
+void drop_cache_set_budget(const size_t bytes);
+void drop_cache_clear(void);
+void drop_cache_stats(DropCacheStats* out);
 
 #ifdef __cplusplus
 }
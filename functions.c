@@ -2,6 +2,7 @@
 #define FUNCTIONS_C
 #include "defs.c"
 #include "array_functions.c"
+#include "operators.c"
 #include "drop.h"
 
 // This file implements and dispatches "functions" (expressions which use
@@ -11,6 +12,8 @@
 // stack_top[0] == c
 // stack_top[-1] == b
 // stack_top[-2] == a
+// Like the operators, functions free their arguments' arrays even when they
+// fail, in which case they return invalid_token().
 
 /**
  * Represents "advantage", the distribution of the maximum of two samples
@@ -26,9 +29,9 @@ Token adv(Token* stack_top, int64_t* num_args) {
         return t;
     }
     if (t.type != PMF) {
-        fprintf(stderr, "Invalid argument for adv: '%c'\n", t.type);
-        Exit(1);
-        return t;
+        fprintf(ERR_STREAM, "Invalid argument for adv: '%c'\n", t.type);
+        free_token(t);
+        return invalid_token();
     }
     arr_order_stat(t.arr, t.len, 2, 2);
     return t;
@@ -48,9 +51,9 @@ Token dis(Token* stack_top, int64_t* num_args) {
         return t;
     }
     if (t.type != PMF) {
-        fprintf(stderr, "Invalid argument for dis: '%c'\n", t.type);
-        Exit(1);
-        return t;
+        fprintf(ERR_STREAM, "Invalid argument for dis: '%c'\n", t.type);
+        free_token(t);
+        return invalid_token();
     }
     arr_order_stat(t.arr, t.len, 2, 1);
     return t;
@@ -70,14 +73,18 @@ Token order_stat(Token* stack_top, int64_t* num_args) {
     *num_args = 3;
     Token t = stack_top[-2];
     if (t.type == CONSTANT) {
+        free_token(stack_top[-1]);
+        free_token(stack_top[0]);
         return t;
     }
     if ((t.type != PMF) || (stack_top[-1].type != CONSTANT)
                         || (stack_top[0].type != CONSTANT)) {
-        fprintf(stderr, "Invalid types: order_stat('%c', '%c', '%c')\n",
+        fprintf(ERR_STREAM, "Invalid types: order_stat('%c', '%c', '%c')\n",
                 t.type, stack_top[-1].type, stack_top[0].type);
-        Exit(1);
-        return t;
+        for (int i = -2; i <= 0; i++) {
+            free_token(stack_top[i]);
+        }
+        return invalid_token();
     }
     int64_t trials = stack_top[0].left;
     int64_t position = stack_top[-1].left;
@@ -93,15 +100,144 @@ Token order_stat(Token* stack_top, int64_t* num_args) {
         position = trials + position;
     }
     if ((1 > position) || (position > trials)) {
-        fprintf(stderr, "Illegal values for order_stat(.., trials=%ld, position=%ld)\n",
+        fprintf(ERR_STREAM, "Illegal values for order_stat(.., trials=%ld, position=%ld)\n",
                 trials, position);
-        Exit(1);
-        return t;
+        free(t.arr);
+        return invalid_token();
     }
     //printf("order_stat(.., trials=%ld, position=%ld)\n", trials, position);
     arr_order_stat(t.arr, t.len, trials, position);
     return t;
 }
+// Limits for keep and keep2. For each outcome o of the dice, solve_pool in
+// drop.cpp goes through every state (how many of each kind of dice are left)
+// and every state that can come before it, adding up arrays of length about
+// kept*(o-lowest). KEEP_MAX_WORK bounds the total, which takes a second or so.
+#define KEEP_MAX_DICE 500
+#define KEEP_MAX_WORK 1e10
+
+/**
+ * Helper for keep and keep2. Keeps the highest keep (or lowest -keep) dice out
+ * of a pool with counts[t].left dice distributed like dists[t]. Frees the
+ * arrays of all of its arguments.
+ *
+ * \param[in] dists Distributions of each kind of die, PMFs or constants
+ * \param[in] counts Number of dice of each kind, constants
+ * \param types Number of kinds of dice
+ * \param keep Number of dice to keep, a constant
+ * \param name Name of the calling function, for error messages
+ */
+Token keep_pool(Token* dists, const Token* counts, const int types,
+                const Token keep, const char* name) {
+    Token out = dists[0];
+    int valid = keep.type == CONSTANT;
+    int64_t total = 0;
+    for (int t = 0; t < types; t++) {
+        if ((dists[t].type != PMF && dists[t].type != CONSTANT)
+            || counts[t].type != CONSTANT || counts[t].left < 0) {
+            valid = 0;
+        }
+        total += counts[t].left;
+    }
+    const int64_t kept = (keep.left < 0) ? -keep.left : keep.left;
+    int too_many = kept > KEEP_MAX_DICE;
+    double work = kept;
+    int64_t lo = INT64_MAX;
+    int64_t hi = INT64_MIN;
+    for (int t = 0; t < types && valid; t++) {
+        const int64_t c = counts[t].left;
+        too_many |= c > KEEP_MAX_DICE;
+        work *= (c+1)*(c+2)/2.0; // pairs of states
+        const int64_t top = dists[t].left + ((dists[t].type == PMF)
+                                             ? (dists[t].len-1)*dists[t].stride : 0);
+        lo = (dists[t].left < lo) ? dists[t].left : lo;
+        hi = (top > hi) ? top : hi;
+    }
+    work *= (double)(hi-lo+1)*(hi-lo+1)/2;
+    too_many |= work > KEEP_MAX_WORK;
+    if (!valid) {
+        fprintf(ERR_STREAM, "Invalid arguments for %s\n", name);
+    } else if (too_many) {
+        fprintf(ERR_STREAM, "Too many dice for %s\n", name);
+        valid = 0;
+    }
+    if (!valid) {
+        for (int t = 0; t < types; t++) {
+            free_token(dists[t]);
+            free_token(counts[t]);
+        }
+        free_token(keep);
+        return invalid_token();
+    }
+    if (total == 0 || keep.left == 0) { // nothing to add up
+        for (int t = 0; t < types; t++) {
+            if (dists[t].type == PMF) {
+                free(dists[t].arr);
+            }
+        }
+        out.type = CONSTANT;
+        out.left = 0;
+        return out;
+    }
+    const double* pmfs[types];
+    int64_t lefts[types];
+    int64_t lens[types];
+    int nums[types];
+    double one = 1.0; // constants are PMFs of length 1
+    for (int t = 0; t < types; t++) {
+        const int is_pmf = dists[t].type == PMF;
+        if (is_pmf) {
+            dists[t] = T_dense(dists[t]);
+        }
+        pmfs[t] = is_pmf ? dists[t].arr : &one;
+        lefts[t] = dists[t].left;
+        lens[t] = is_pmf ? dists[t].len : 1;
+        nums[t] = counts[t].left;
+    }
+    out.type = PMF;
+    out.stride = 1;
+    out.arr = drop_pool(types, pmfs, lefts, lens, nums, keep.left,
+                        &out.left, &out.len);
+    for (int t = 0; t < types; t++) {
+        if (dists[t].type == PMF) {
+            free(dists[t].arr);
+        }
+    }
+    if (out.len == 1) {
+        free(out.arr);
+        out.type = CONSTANT;
+    }
+    return out;
+}
+
+/**
+ * Keeps the highest few of several rolls of the same distribution, like
+ * 4d6kh3 but for any distribution. A negative number keeps the lowest.
+ * User usage: keep(distribution, rolls, number_kept), ie keep(1d6+1d4, 4, 3)
+ *
+ * \param[in,out] stack_top Pointer to the top of the RPN stack
+ * \param[out] num_args Place to store the number of arguments popped off the stack
+ */
+Token keep(Token* stack_top, int64_t* num_args) {
+    *num_args = 3;
+    return keep_pool(stack_top-2, stack_top-1, 1, stack_top[0], "keep");
+}
+
+/**
+ * Like keep, but with two kinds of dice in the pool.
+ * User usage: keep2(dist1, rolls1, dist2, rolls2, number_kept), so the highest
+ * 2 of 2d6+1d8 is keep2(1d6, 2, 1d8, 1, 2)
+ *
+ * \param[in,out] stack_top Pointer to the top of the RPN stack
+ * \param[out] num_args Place to store the number of arguments popped off the stack
+ */
+Token keep2(Token* stack_top, int64_t* num_args) {
+    *num_args = 5;
+    Token dists[2] = {stack_top[-4], stack_top[-2]};
+    Token counts[2] = {stack_top[-3], stack_top[-1]};
+    return keep_pool(dists, counts, 2, stack_top[0], "keep2");
+}
+
 /**
  * Calculates things along the line of 4d6dl.
  * User usage: drop(faces, total, keep)
@@ -116,9 +252,8 @@ Token drop_func(Token* stack_top, int64_t* num_args) {
     Token total = stack_top[-1];
     Token faces = stack_top[-2];
     if (keep.type != CONSTANT || total.type != CONSTANT || faces.type != CONSTANT) {
-        fprintf(stderr, "drop can only take integer arguments\n");
-        Exit(1);
-        return faces;
+        fprintf(ERR_STREAM, "drop can only take integer arguments\n");
+        return invalid_token();
     }
     faces.arr = drop(total.left, faces.left, keep.left, &faces.left, &faces.len);
     faces.type = PMF;
@@ -128,18 +263,20 @@ Token drop_func(Token* stack_top, int64_t* num_args) {
 
 /**
  * Struct used to associate a function (pointer) with a string representing
- * the function's name.
+ * the function's name, and the number of arguments it takes.
  */
 typedef struct FuncTuple {
     char* name;
     Token (*func)(Token* st, int64_t* n);
+    int num_args;
 } FuncTuple;
 
 FuncTuple func_arr[] = { // keep this array sorted, for convenience
-    {"adv", adv}, {"advantage", adv},
-    {"dis", dis}, {"disadvantage", dis},
-    //{"drop", drop_func},
-    {"order", order_stat}, {"order_stat", order_stat},
+    {"adv", adv, 1}, {"advantage", adv, 1},
+    {"dis", dis, 1}, {"disadvantage", dis, 1},
+    //{"drop", drop_func, 3},
+    {"keep", keep, 3}, {"keep2", keep2, 5},
+    {"order", order_stat, 3}, {"order_stat", order_stat, 3},
 };
 
 /**
@@ -147,11 +284,14 @@ FuncTuple func_arr[] = { // keep this array sorted, for convenience
  * later call the correct function without needing a ton of else-ifs.
  * 
  * \param funcname The name of the function to look up.
- * \return A token that keeps track of the relevant function.
+ * \return A token that keeps track of the relevant function, or
+ * invalid_token() if there's no such function
  */
 Token choose_func(const char funcname[]) {
     Token out;
     out.left = -1;
+    out.stride = 1;
+    out.values = NULL;
     out.type = FUNCTION;
     // If this ever gets big I could use binary/interpolation search or
     // something but that doesn't matter for now.
@@ -161,9 +301,8 @@ Token choose_func(const char funcname[]) {
         }
     }
     if (out.left == -1) {
-        fprintf(stderr, "No function named \"%s\"\n", funcname);
-        Exit(1);
-        return out;
+        fprintf(ERR_STREAM, "No function named \"%s\"\n", funcname);
+        return invalid_token();
     }
     return out;
 }
@@ -178,6 +317,19 @@ Token choose_func(const char funcname[]) {
  */
 Token apply_func(const Token t, Token* stack_top, int64_t* num_args) {
     int64_t func_id = t.left;
+    // None of the functions know about sparse PMFs
+    int failed = 0;
+    for (int i = 0; i < func_arr[func_id].num_args; i++) {
+        stack_top[-i] = T_unsparse(stack_top[-i]);
+        failed |= stack_top[-i].type == INVALID;
+    }
+    if (failed) {
+        for (int i = 0; i < func_arr[func_id].num_args; i++) {
+            free_token(stack_top[-i]);
+        }
+        *num_args = func_arr[func_id].num_args;
+        return invalid_token();
+    }
     return func_arr[func_id].func(stack_top, num_args);
 }
 #endif
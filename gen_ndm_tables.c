@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// This program writes ndm_tables.c, which has the PMFs of the most common
+// dice pools (NdM for M in 4, 6, 8, 10, 12, 20, 100 and small N) baked in, so
+// that ndm can just copy them instead of doing any convolutions.
+// make.sh runs it as
+//     ./gen_ndm_tables [max_n] > ndm_tables.c
+// where max_n (default 10) is the biggest N to include. The counts are worked
+// out exactly with 128-bit integers, so pools whose M^N doesn't fit in 128
+// bits are left out.
+
+typedef unsigned __int128 u128;
+
+const int faces[] = {4, 6, 8, 10, 12, 20, 100};
+
+/**
+ * Prints the PMF of n dice with m faces as a static array, if m^n fits in
+ * 128 bits.
+ *
+ * \return 1 if it was printed, 0 if m^n is too big
+ */
+int print_table(const int n, const int m) {
+    u128 total = 1;
+    for (int i = 0; i < n; i++) {
+        if (total > ((u128)-1)/m) {
+            return 0;
+        }
+        total *= m;
+    }
+    const int len = n*(m-1)+1;
+    // counts[s] = number of ways for the first k dice to add up to s+k
+    u128* counts = calloc(len, sizeof(u128));
+    u128* next = calloc(len, sizeof(u128));
+    counts[0] = 1;
+    for (int k = 1; k < n; k++) {
+        memset(next, 0, len*sizeof(u128));
+        for (int s = 0; s <= (k-1)*(m-1); s++) {
+            for (int f = 0; f < m; f++) {
+                next[s+f] += counts[s];
+            }
+        }
+        u128* temp = counts;
+        counts = next;
+        next = temp;
+    }
+    // one more die, but only keep the answer
+    memset(next, 0, len*sizeof(u128));
+    for (int s = 0; s <= (n-1)*(m-1); s++) {
+        for (int f = 0; f < m; f++) {
+            next[s+f] += counts[s];
+        }
+    }
+    printf("static const double ndm_table_%d_%d[%d] = {", n, m, len);
+    for (int s = 0; s < len; s++) {
+        const double p = (double)((long double)next[s]/(long double)total);
+        printf("%s%.17g", (s % 4 == 0) ? "\n    " : " ", p);
+        if (s < len-1) {
+            printf(",");
+        }
+    }
+    printf("\n};\n");
+    free(counts);
+    free(next);
+    return 1;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_n = 10;
+    if (argc > 1) {
+        max_n = atoi(argv[1]);
+    }
+    printf("// Generated by gen_ndm_tables.c, don't edit this by hand.\n");
+    printf("#ifndef NDM_TABLES_C\n#define NDM_TABLES_C\n\n");
+    printf("#define NDM_TABLE_MAX_N %d\n\n", max_n);
+    printf("typedef struct NdmTable {\n    int n;\n    int m;\n"
+           "    const double* pmf; // length n*(m-1)+1\n} NdmTable;\n\n");
+    // which pools made it in, so we can list them at the end
+    int (*done)[2] = malloc(sizeof(faces)/sizeof(int)*(max_n+1)*sizeof(*done));
+    int num_done = 0;
+    for (int i = 0; i < (int)(sizeof(faces)/sizeof(int)); i++) {
+        for (int n = 1; n <= max_n; n++) {
+            if (print_table(n, faces[i])) {
+                done[num_done][0] = n;
+                done[num_done][1] = faces[i];
+                num_done++;
+            }
+        }
+    }
+    printf("\nconst NdmTable ndm_tables[] = {\n");
+    for (int i = 0; i < num_done; i++) {
+        printf("    {%d, %d, ndm_table_%d_%d},\n", done[i][0], done[i][1],
+               done[i][0], done[i][1]);
+    }
+    printf("};\n\nconst int ndm_tables_len = %d;\n\n#endif\n", num_done);
+    free(done);
+    return 0;
+}
@@ -5,19 +5,32 @@
 #include "defs.c"
 #include "term_size.c"
 #include "plot.c"
-#include "parse.c"
-#include "pemdas.c"
+#include "output.c"
+#include "dice.c"
 #include "better-fgets/enter_line.c"
+#include "batch.c"
 
+/**
+ * Parses and works out the input.
+ *
+ * \param[out] t Place to store the result
+ * \return 0 on success, -1 if the input couldn't be parsed, -2 if it couldn't
+ * be worked out (the reason has been printed)
+ */
 int main_parse(int argc, char const *argv[], Token* t) {
     int n = parse_token_main(argc, argv);
     if (n == -1) {
         return -1;
     }
+    CTX->pruned_mass = 0.0;
     *t = pemdas(TOKEN_BUF, n);
-    return 0;
+    return (t->type == INVALID) ? -2 : 0;
 }
 
+// Most entries we plot. Sparse results more spread out than this are plotted
+// in buckets.
+#define PLOT_MAX_LEN (1LL << 20)
+
 void main_plot(Token t) {
     int rows, cols;
     get_term_size(&rows, &cols);
@@ -30,24 +43,91 @@ void main_plot(Token t) {
         cols = 80;
     }
     //fprintf(stderr, "rows: %d, cols: %d\n", rows, cols);
-    draw(rows, cols, t.arr, t.left, t.len);
-    return;
+    double* stats = NULL;
+    double exact[2];
+    if (t.type == SPARSE) {
+        // the buckets would throw off the mean and standard deviation a bit
+        double* cdf = malloc(t.len*sizeof(double));
+        pmf_summary(t.arr, t.values, t.len, t.left, 0, cdf, &exact[0], &exact[1]);
+        free(cdf);
+        stats = exact;
+        SparsePMF x = T_to_sparse(t);
+        free_token(t);
+        t.type = PMF;
+        t.arr = sparse_to_buckets(x, PLOT_MAX_LEN, &t.left, &t.len, &t.stride);
+    }
+    draw(rows, cols, t.arr, t.left, t.len, t.stride, stats);
+    free(t.arr);
 }
 
-void handle_main(int argc, char const *argv[]) {
+/**
+ * Works out the input and prints the result.
+ *
+ * \return 0 on success, 1 if something went wrong
+ */
+int handle_main(int argc, char const *argv[]) {
     Token t;
-    if (main_parse(argc, argv, &t) == -1) {
-        fprintf(stderr, "Invalid input.\n");
-        return;
+    const int code = main_parse(argc, argv, &t);
+    if (code == -1) {
+        fprintf(ERR_STREAM, "Invalid input.\n");
+    }
+    if (code != 0) {
+        return 1;
     }
-    if (t.type == CONSTANT || (t.type == PMF && t.len==1)) {
-        printf("answer is always %ld\n", t.left);
-        if (t.type == PMF) {
-            free(t.arr);
+    if (output_mode != OUTPUT_PLOT) {
+        if (t.type == CONSTANT) {
+            const double one = 1.0;
+            output_pmf(&one, NULL, 1, t.left, 1, CTX->pruned_mass);
+        } else {
+            output_pmf(t.arr, (t.type == SPARSE) ? t.values : NULL, t.len,
+                       t.left, t.stride, CTX->pruned_mass);
+            free_token(t);
         }
+    } else if (t.type == CONSTANT || (t.type == PMF && t.len==1)) {
+        fprintf(OUT_STREAM, "answer is always %ld\n", t.left);
+        free_token(t);
     } else {
         main_plot(t);
-        free(t.arr);
+    }
+    if (CTX->pruned_mass > 0.0) {
+        fprintf(ERR_STREAM, "(Ignored %.3g probability in the tails, see DICE_PRUNE)\n",
+                CTX->pruned_mass);
+    }
+    return 0;
+}
+
+/**
+ * Prints cache statistics, for the ":stats" command in interactive mode.
+ */
+void print_stats() {
+    DropCacheStats stats;
+    drop_cache_stats(&stats);
+    fprintf(stderr, "drop cache: %zu entries, %.1f/%.1f MB, %llu hits, "
+            "%llu misses, %llu evictions\n", stats.entries,
+            stats.bytes/(1024.0*1024), stats.budget/(1024.0*1024),
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions);
+    const ExprMemo* memo = get_expr_memo();
+    int memo_entries = 0;
+    for (int i = 0; i < EXPR_MEMO_SIZE; i++) {
+        memo_entries += memo->entries[i].last_used != 0;
+    }
+    fprintf(stderr, "expression memo: %d entries, %.1f MB, %llu hits, "
+            "%llu misses\n", memo_entries, memo->bytes/(1024.0*1024),
+            (unsigned long long)memo->hits,
+            (unsigned long long)memo->misses);
+    ResultCacheStats results;
+    result_cache_stats(&results);
+    if (results.open) {
+        fprintf(stderr, "result cache: %zu entries, %llu hits, "
+                "%llu written\n", results.entries,
+                (unsigned long long)results.hits,
+                (unsigned long long)results.writes);
+    }
+    if (stats.snapshot_entries > 0) {
+        fprintf(stderr, "drop snapshot: %zu entries, %llu hits\n",
+                stats.snapshot_entries,
+                (unsigned long long)stats.snapshot_hits);
     }
 }
 
@@ -105,6 +185,10 @@ void interactive_mode() {
                 return;
             }
         }
+        if (!strcmp(interactive_buf, ":stats")) {
+            print_stats();
+            continue;
+        }
         //if (fgets(interactive_buf, 1024, stdin) == NULL) {
         //    fprintf(stderr, "Exiting.\n");
         //    return;
@@ -115,11 +199,14 @@ void interactive_mode() {
 }
 
 int main(int argc, char const *argv[]) {
+    dice_init();
+    init_output_mode();
+    if (argc >= 2 && !strcmp(argv[1], "--batch")) {
+        return batch_mode(argc > 2 ? argv[2] : NULL);
+    }
     if (argc < 2) {
-        exit_flag = 1;
         interactive_mode();
         return 0;
     }
-    handle_main(argc, argv); 
-    return 0;
+    return handle_main(argc, argv);
 }
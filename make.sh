@@ -2,15 +2,22 @@
 # make is too complicated lol
 # build for linux. I use Os because from testing on my computer it seems to be
 # the fastest.
+# Common pools like 3d6 are precomputed. DICE_TABLE_MAX_N is the most dice
+# in a precomputed pool.
+gcc -O2 -std=c99 gen_ndm_tables.c -o gen_ndm_tables
+./gen_ndm_tables ${DICE_TABLE_MAX_N:-10} > ndm_tables.c
 gcc -Os -std=c99 -c pocketfft/pocketfft.c -o pocketfft.o
-gcc -Os -W -Wall -Wextra -Werror -std=c99 -c main.c -lm -o main.o
-g++ -Os -Wall -Wextra -Werror -std=c++11 -c drop.cpp -o drop.o
-g++ -Os -o dice-linux main.o drop.o pocketfft.o -static
+gcc -Os -W -Wall -Wextra -Werror -std=c99 -fopenmp -c main.c -lm -o main.o
+g++ -Os -Wall -Wextra -Werror -std=c++11 -fopenmp -c drop.cpp -o drop.o
+g++ -Os -fopenmp -o dice-linux main.o drop.o pocketfft.o -static
+# the library (see dice.h). link programs that use it with -fopenmp -lm -lstdc++
+gcc -Os -W -Wall -Wextra -Werror -std=c99 -fopenmp -c dice.c -o dice-lib.o
+ar rcs libdice.a dice-lib.o drop.o pocketfft.o
 
 # build for windows. we use mingw because MSVC somehow still doesn't properly
 # support C complex numbers. I use -O2 because from testing on my computer,
 # windows defender thinks it's a virus with -O3 or -Os.
 x86_64-w64-mingw32-gcc -O2 -std=c99 -c pocketfft/pocketfft.c -o pocketfft-win.o -D__USE_MINGW_ANSI_STDIO=0
-x86_64-w64-mingw32-gcc -O2 -std=c99 -c -lm main.c -o main-win.o -D__USE_MINGW_ANSI_STDIO=0
-x86_64-w64-mingw32-g++ -O2 -std=c++11 -c drop.cpp -o drop-win.o -D__USE_MINGW_ANSI_STDIO=0
-x86_64-w64-mingw32-g++ -O2 -o dice-windows.exe main-win.o drop-win.o pocketfft-win.o -static -D__USE_MINGW_ANSI_STDIO=0
+x86_64-w64-mingw32-gcc -O2 -std=c99 -fopenmp -c -lm main.c -o main-win.o -D__USE_MINGW_ANSI_STDIO=0
+x86_64-w64-mingw32-g++ -O2 -std=c++11 -fopenmp -c drop.cpp -o drop-win.o -D__USE_MINGW_ANSI_STDIO=0
+x86_64-w64-mingw32-g++ -O2 -fopenmp -o dice-windows.exe main-win.o drop-win.o pocketfft-win.o -static -D__USE_MINGW_ANSI_STDIO=0
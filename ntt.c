@@ -0,0 +1,370 @@
+#ifndef NTT_C
+#define NTT_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+// This file implements exact convolutions of integer count arrays using
+// number theoretic transforms (NTTs), ie FFTs over the integers mod a prime.
+// One transform only gives the answer mod p, so we do the same convolution
+// mod several primes and glue the results back together with the Chinese
+// remainder theorem (Garner's algorithm). That's exact as long as the product
+// of the primes is bigger than the biggest count, and never needs bignums,
+// because the final step converts straight to a scaled double.
+
+// Every prime we use is of the form c*2^NTT_MAX_LOG2_LEN + 1, so all of them
+// have roots of unity for every power of two length up to 2^NTT_MAX_LOG2_LEN.
+#define NTT_MAX_LOG2_LEN 22
+// There are 96 primes of that form below 2^32, which gives about 2900 bits.
+#define NTT_MAX_PRIMES 96
+
+uint32_t ntt_primes[NTT_MAX_PRIMES];
+uint32_t ntt_roots[NTT_MAX_PRIMES]; // primitive root mod each prime
+int ntt_num_primes = 0;
+
+/**
+ * \return a*b mod p
+ */
+uint32_t mulmod32(const uint32_t a, const uint32_t b, const uint32_t p) {
+    return (uint32_t)(((uint64_t)a*b) % p);
+}
+
+// Precomputed floor((2^64-1)/p), so that x mod p takes two multiplications
+// instead of a 64-bit division (Barrett reduction).
+typedef struct Barrett {
+    uint32_t p;
+    uint64_t m;
+} Barrett;
+
+/**
+ * \return A Barrett for reducing mod p
+ */
+Barrett make_barrett(const uint32_t p) {
+    Barrett b;
+    b.p = p;
+    b.m = UINT64_MAX/p;
+    return b;
+}
+
+/**
+ * \return The top 64 bits of a*b
+ */
+uint64_t mulhi64(const uint64_t a, const uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)a*b) >> 64);
+#else
+    const uint64_t lo_lo = (a & 0xFFFFFFFF)*(b & 0xFFFFFFFF);
+    const uint64_t hi_lo = (a >> 32)*(b & 0xFFFFFFFF);
+    const uint64_t lo_hi = (a & 0xFFFFFFFF)*(b >> 32);
+    const uint64_t hi_hi = (a >> 32)*(b >> 32);
+    const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+/**
+ * \return x mod b.p, for any 64-bit x
+ */
+uint32_t barrett_reduce(const uint64_t x, const Barrett b) {
+    // the quotient estimate is at most one too small
+    uint64_t r = x - mulhi64(x, b.m)*b.p;
+    return (uint32_t)((r >= b.p) ? r-b.p : r);
+}
+
+/**
+ * \return a^e mod p
+ */
+uint32_t powmod32(uint32_t a, uint64_t e, const uint32_t p) {
+    uint32_t out = 1;
+    while (e) {
+        if (e & 1) {
+            out = mulmod32(out, a, p);
+        }
+        a = mulmod32(a, a, p);
+        e >>= 1;
+    }
+    return out;
+}
+
+/**
+ * Deterministic Miller-Rabin test. The bases 2, 7, 61 are enough for any
+ * 32-bit number.
+ *
+ * \param n Number to test
+ * \return True if n is prime
+ */
+int is_prime32(const uint32_t n) {
+    if (n < 2) {
+        return 0;
+    }
+    const uint32_t small[] = {2, 3, 5, 7, 11, 13, 61};
+    for (int i = 0; i < 7; i++) {
+        if (n % small[i] == 0) {
+            return n == small[i];
+        }
+    }
+    uint32_t d = n-1;
+    int s = 0;
+    while (d % 2 == 0) {
+        d /= 2;
+        s++;
+    }
+    const uint32_t bases[] = {2, 7, 61};
+    for (int i = 0; i < 3; i++) {
+        uint32_t x = powmod32(bases[i], d, n);
+        if (x == 1 || x == n-1) {
+            continue;
+        }
+        int composite = 1;
+        for (int r = 1; r < s; r++) {
+            x = mulmod32(x, x, n);
+            if (x == n-1) {
+                composite = 0;
+                break;
+            }
+        }
+        if (composite) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Finds a primitive root mod p, where p-1 = c*2^k.
+ *
+ * \param p Prime
+ * \return Smallest primitive root mod p
+ */
+uint32_t find_primitive_root(const uint32_t p) {
+    // prime factors of p-1
+    uint32_t factors[32];
+    int num_factors = 0;
+    uint32_t rest = p-1;
+    for (uint32_t q = 2; q*q <= rest; q++) {
+        if (rest % q == 0) {
+            factors[num_factors++] = q;
+            while (rest % q == 0) {
+                rest /= q;
+            }
+        }
+    }
+    if (rest > 1) {
+        factors[num_factors++] = rest;
+    }
+    for (uint32_t g = 2; g < p; g++) {
+        int ok = 1;
+        for (int i = 0; i < num_factors; i++) {
+            if (powmod32(g, (p-1)/factors[i], p) == 1) {
+                ok = 0;
+                break;
+            }
+        }
+        if (ok) {
+            return g;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fills in ntt_primes and ntt_roots, biggest primes first. Only does
+ * anything the first time it's called.
+ */
+void init_ntt_primes() {
+    if (ntt_num_primes > 0) {
+        return;
+    }
+    for (uint64_t c = (1ULL << (32-NTT_MAX_LOG2_LEN))-1; c > 0; c--) {
+        uint64_t p = (c << NTT_MAX_LOG2_LEN) + 1;
+        if (p < (1ULL << 32) && is_prime32((uint32_t)p)) {
+            ntt_primes[ntt_num_primes] = (uint32_t)p;
+            ntt_roots[ntt_num_primes] = find_primitive_root((uint32_t)p);
+            ntt_num_primes++;
+            if (ntt_num_primes == NTT_MAX_PRIMES) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * In-place iterative radix-2 NTT.
+ *
+ * \param[in,out] a Array of residues mod p
+ * \param len Length of a, a power of two no bigger than 2^NTT_MAX_LOG2_LEN
+ * \param p Prime modulus
+ * \param g Primitive root mod p
+ * \param inverse If true, does the inverse transform (including the 1/len)
+ */
+void ntt(uint32_t* a, const int64_t len, const uint32_t p, const uint32_t g,
+         const int inverse) {
+    for (int64_t i = 1, j = 0; i < len; i++) {
+        int64_t bit = len >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            uint32_t temp = a[i];
+            a[i] = a[j];
+            a[j] = temp;
+        }
+    }
+    const Barrett b = make_barrett(p);
+    uint32_t* w = malloc((len/2 > 0 ? len/2 : 1)*sizeof(uint32_t));
+    for (int64_t half = 1; half < len; half *= 2) {
+        uint32_t step = powmod32(g, (p-1)/(2*half), p);
+        if (inverse) {
+            step = powmod32(step, p-2, p);
+        }
+        w[0] = 1;
+        for (int64_t k = 1; k < half; k++) {
+            w[k] = mulmod32(w[k-1], step, p);
+        }
+        for (int64_t i = 0; i < len; i += 2*half) {
+            for (int64_t k = 0; k < half; k++) {
+                uint32_t u = a[i+k];
+                uint32_t v = barrett_reduce((uint64_t)a[i+k+half]*w[k], b);
+                a[i+k] = (u+v >= p || u+v < u) ? u+v-p : u+v;
+                a[i+k+half] = (u >= v) ? u-v : u+(p-v);
+            }
+        }
+    }
+    free(w);
+    if (inverse) {
+        uint32_t inv_len = powmod32((uint32_t)(len % p), p-2, p);
+        for (int64_t i = 0; i < len; i++) {
+            a[i] = mulmod32(a[i], inv_len, p);
+        }
+    }
+}
+
+/**
+ * Computes counts(x)^n * counts(y) exactly (where ^ and * mean convolution),
+ * then writes each entry times a scale factor to out as a double.
+ *
+ * The scale factor is passed as scale_mant * 2^scale_exp so that it can be
+ * much smaller than DBL_MIN, eg 1/1000^1000 for 1000d1000.
+ *
+ * \param[in] x Integer counts
+ * \param xlen Length of x
+ * \param n Number of times x is convolved with itself (n >= 1)
+ * \param[in] y Integer counts, or NULL to just compute x^n
+ * \param ylen Length of y (ignored if y is NULL)
+ * \param log2_bound Upper bound on log2 of every output count
+ * \param scale_mant Mantissa of scale factor
+ * \param scale_exp Binary exponent of scale factor
+ * \param[out] out Output array of length (xlen-1)*n + ylen (or (xlen-1)*n+1)
+ * \return 0 on success, -1 if the output is too long or needs too many primes
+ */
+int ntt_exact_convolve(const uint64_t* x, const int64_t xlen, const int64_t n,
+                       const uint64_t* y, const int64_t ylen,
+                       const double log2_bound, const double scale_mant,
+                       const int64_t scale_exp, double* out) {
+    init_ntt_primes();
+    const int64_t outlen = (xlen-1)*n + (y == NULL ? 1 : ylen);
+    int64_t len = 1;
+    while (len < outlen) {
+        len *= 2;
+    }
+    if (len > (1LL << NTT_MAX_LOG2_LEN)) {
+        return -1;
+    }
+    int num = 0;
+    double bits = 0.0;
+    while (bits <= log2_bound + 1.0) {
+        if (num == ntt_num_primes) {
+            return -1;
+        }
+        bits += log2(ntt_primes[num++]);
+    }
+    uint32_t* residues = malloc(num*len*sizeof(uint32_t));
+    uint32_t* other = (y == NULL) ? NULL : malloc(len*sizeof(uint32_t));
+    for (int k = 0; k < num; k++) {
+        const uint32_t p = ntt_primes[k];
+        const uint32_t g = ntt_roots[k];
+        uint32_t* a = residues + k*len;
+        memset(a, 0, len*sizeof(uint32_t));
+        for (int64_t i = 0; i < xlen; i++) {
+            a[i] = x[i] % p;
+        }
+        ntt(a, len, p, g, 0);
+        for (int64_t i = 0; i < len; i++) {
+            a[i] = powmod32(a[i], n, p);
+        }
+        if (y != NULL) {
+            memset(other, 0, len*sizeof(uint32_t));
+            for (int64_t i = 0; i < ylen; i++) {
+                other[i] = y[i] % p;
+            }
+            ntt(other, len, p, g, 0);
+            for (int64_t i = 0; i < len; i++) {
+                a[i] = mulmod32(a[i], other[i], p);
+            }
+        }
+        ntt(a, len, p, g, 1);
+    }
+    free(other);
+    // Garner's algorithm: count = v[0] + v[1]*P[1] + v[2]*P[2] + ...
+    // where P[k] = p[0]*...*p[k-1] and 0 <= v[k] < p[k]. Every term is
+    // positive, so adding them up in floating point keeps full relative
+    // precision, even in the far tails.
+    //
+    // Finding v[k] takes k steps for each entry, so this is O(num^2) per
+    // entry against O(num*log(len)) for the transforms. Everything it needs
+    // mod p[k] is worked out here, so each step is one Barrett reduction.
+    Barrett* mod = malloc(num*sizeof(Barrett));
+    uint32_t* prime_mod = malloc(num*num*sizeof(uint32_t)); // p[j] mod p[k]
+    uint32_t* inv = malloc(num*sizeof(uint32_t)); // 1/P[k] mod p[k]
+    double* weight = malloc(num*sizeof(double)); // P[k]*scale
+    int e;
+    double mant = frexp(scale_mant, &e);
+    int64_t exp = scale_exp + e;
+    for (int k = 0; k < num; k++) {
+        mod[k] = make_barrett(ntt_primes[k]);
+        uint32_t prod = 1;
+        for (int j = 0; j < k; j++) {
+            prime_mod[k*num + j] = ntt_primes[j] % ntt_primes[k];
+            prod = mulmod32(prod, prime_mod[k*num + j], ntt_primes[k]);
+        }
+        inv[k] = powmod32(prod, ntt_primes[k]-2, ntt_primes[k]);
+        weight[k] = (exp < -1100) ? 0.0 : ldexp(mant, (int)exp);
+        mant = frexp(mant*ntt_primes[k], &e);
+        exp += e;
+    }
+    uint32_t* v = malloc(num*sizeof(uint32_t));
+    for (int64_t i = 0; i < outlen; i++) {
+        double sum = 0.0;
+        for (int k = 0; k < num; k++) {
+            const uint32_t p = ntt_primes[k];
+            const uint32_t* pm = prime_mod + k*num;
+            // t = (v[0] + v[1]*P[1] + ... + v[k-1]*P[k-1]) mod p, by Horner.
+            // t*pm[j] + v[j] < p^2 + 2^32 fits in 64 bits.
+            uint32_t t = 0;
+            for (int j = k-1; j >= 0; j--) {
+                t = barrett_reduce((uint64_t)t*pm[j] + v[j], mod[k]);
+            }
+            uint32_t r = residues[k*len + i];
+            v[k] = barrett_reduce((uint64_t)((r >= t) ? r-t : r+(p-t))*inv[k], mod[k]);
+        }
+        for (int k = num-1; k >= 0; k--) {
+            if (v[k] != 0) {
+                sum += v[k]*weight[k];
+            }
+        }
+        out[i] = sum;
+    }
+    free(v);
+    free(weight);
+    free(inv);
+    free(prime_mod);
+    free(mod);
+    free(residues);
+    return 0;
+}
+
+#endif
@@ -1,5 +1,9 @@
+#ifndef OPERATORS_C
+#define OPERATORS_C
 #include "defs.c"
 #include "array_math.c"
+#include "sparse.c"
+#include "drop.h"
 
 // This file implements arithmetic operators on tokens.
 // Any particurly fancy algorithming should be implemented in array_math.c
@@ -10,8 +14,27 @@
  */
 void prepare_token(Token* t) {
     if (t->type == DROPPER) {
+        // left: number of dice, right: faces, len: number to keep
+        // (negative to keep the lowest)
+        const int64_t n = t->left;
+        const int64_t faces = t->right;
+        const int64_t keep = (t->len < 0) ? -(t->len) : t->len;
         t->type = PMF;
-        t->arr = drop(t->right, t->left, t->len, &(t->left), &(t->len));
+        if (keep == 0) { // keeping nothing, always 0
+            t->type = CONSTANT;
+            t->arr = NULL;
+            t->left = 0;
+            t->len = 1;
+        } else if (keep >= n) { // keeping everything
+            t->arr = ndm(n, faces);
+            t->len = n*(faces-1)+1;
+        } else if (keep == 1) { // closed form for the max or min
+            t->arr = keep_one(n, faces, t->len > 0);
+            t->left = 1;
+            t->len = faces;
+        } else {
+            t->arr = drop(faces, n, t->len, &(t->left), &(t->len));
+        }
     } else if (t->type == DICE_EXPRESSION) {
         t->type = PMF;
         t->arr = ndm(t->left, t->right);
@@ -28,6 +51,8 @@ This is where all the memory management happens. Any time a type PMF is input, e
 (1) free(d.arr) is called somewhere
 (2) d.arr = realloc(d.arr, ...) somewhere
 (3) d.arr is modified in-place
+That goes for errors too: an operation that fails frees its inputs the same way and returns
+invalid_token().
 
 Furthermore, any time we perform an operation that can shrink an array, we need to check if
 that can cause the array to have length 1. In that case, free the array and change type to
@@ -46,10 +71,83 @@ ___1D
  * \return The probability that d == n
  */
 double T_at(const Token d, const int64_t n) {
-    if (n < d.left || n >= d.left + d.len) {
+    if (n < d.left || (n - d.left) % d.stride != 0) {
+        return 0.0;
+    }
+    const int64_t k = (n - d.left)/d.stride;
+    if (k >= d.len) {
+        return 0.0;
+    }
+    return d.arr[k];
+}
+
+/**
+ * Helper function.
+ * \param d Token of type PMF
+ * \return The biggest value d can take
+ */
+int64_t T_max(const Token d) {
+    return d.left + (d.len-1)*d.stride;
+}
+
+/**
+ * Helper function. Finds the index of the biggest value of d that's <= n,
+ * which is negative if there isn't one and >= d.len if n > T_max(d).
+ * \param d Token of type PMF
+ * \param n Abscissa value
+ */
+int64_t T_floor_index(const Token d, const int64_t n) {
+    return floor_div(n - d.left, d.stride);
+}
+
+/**
+ * Helper function. Gets P(d <= n), where d.arr has already been replaced by
+ * its cumulative sum.
+ * \param d Token of type PMF, after ip_cumsum
+ * \param n Abscissa value
+ */
+double T_cdf_at(const Token d, const int64_t n) {
+    const int64_t k = T_floor_index(d, n);
+    if (k < 0) {
         return 0.0;
     }
-    return d.arr[n-d.left];
+    return d.arr[k < d.len ? k : d.len-1];
+}
+
+/**
+ * Helper function. Changes the stride of d to a divisor of its stride, by
+ * putting zeros in between the entries.
+ * \param d Token of type PMF
+ * \param stride New stride, must divide d.stride
+ * \return d with the new stride
+ */
+Token T_restride(Token d, const int64_t stride) {
+    // Memory: reallocated + returned by grow_by_int
+    if (d.stride != stride) {
+        d.arr = grow_by_int(d.arr, d.len, d.stride/stride, &(d.len));
+        d.stride = stride;
+    }
+    return d;
+}
+
+/**
+ * Helper function. Converts d to stride 1, for code that doesn't know about
+ * strides.
+ */
+Token T_dense(Token d) {
+    return T_restride(d, 1);
+}
+
+/**
+ * \return The greatest common divisor of a and b, both positive
+ */
+int64_t gcd64(int64_t a, int64_t b) {
+    while (b != 0) {
+        const int64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
 }
 
 Token addD1(Token d, Token i) {
@@ -69,6 +167,13 @@ Token add1D(Token i, Token d) {
 Token addDD(Token d1, Token d2) {
     // Memory: convolve reallocates + returns d1.arr, reallocates + frees d2.arr
     // Cannot shrink
+    // Strides: if they match we convolve at the compact length, otherwise
+    // both are spread out to the gcd of the strides.
+    if (d1.stride != d2.stride) {
+        const int64_t stride = gcd64(d1.stride, d2.stride);
+        d1 = T_restride(d1, stride);
+        d2 = T_restride(d2, stride);
+    }
     // size_t new_len;
     d1.arr = convolve(d1.arr, d1.len, d2.arr, d2.len, &(d1.len));
     //d1.len = new_len;
@@ -88,32 +193,36 @@ Token sub1D(Token i, Token d) {
     // Memory: in-place
     // Cannot shrink
     flip(d.arr, d.len);
-    d.left = i.left-(d.left+d.len-1);
+    d.left = i.left-T_max(d);
     return d;
 }
 
 Token mul1D(Token i, Token d) {
-    // Memory: dynamic, either freed here or reallocated + returned by grow_by_int
+    // Memory: either freed here or in-place
     // Cannot shrink
-    int64_t new_size;
+    // Strides: multiplies the stride instead of putting zeros in between
     if (i.left == 0) {
         free(d.arr);
         i.left = 0;
         return i;
     }
-    d.arr = grow_by_int(d.arr, d.len, i.left, &new_size);
     if (i.left > 0) {
         d.left *= i.left;
+        d.stride *= i.left;
     } else {
-        d.left = (d.left + d.len - 1)*i.left;
+        d.left = T_max(d)*i.left;
+        d.stride *= -i.left;
+        flip(d.arr, d.len);
     }
-    d.len = new_size;
     return d;
 }
 #define mulD1(d,i) mul1D(i,d)
 
 Token mulDD(Token d1, Token d2) {
     // Memory: multiply_pmfs frees d1.arr, d2.arr, and returns a new array
+    // Strides: made dense first
+    d1 = T_dense(d1);
+    d2 = T_dense(d2);
     // Cannot shrink
     int64_t lower, upper;
     d1.arr = multiply_pmfs(d1.arr, d1.len, d2.arr, d2.len,
@@ -126,6 +235,8 @@ Token mulDD(Token d1, Token d2) {
 Token divD1(Token d1, Token i) {
     // Memory: divide_indices frees d1.arr, returns a new array
     // Shrinking is handled
+    // Strides: made dense first
+    d1 = T_dense(d1);
     d1.arr = divide_indices(d1.arr, &(d1.len), &(d1.left), i.left);
     if (d1.len == 1) {
         free(d1.arr);
@@ -137,8 +248,14 @@ Token divD1(Token d1, Token i) {
 Token divDD(Token d1, Token d2) {
     // Memory: divide_pmfs frees d1.arr, d2.arr, returns a new array
     // Shrinking is handled
+    // Strides: made dense first
+    d1 = T_dense(d1);
+    d2 = T_dense(d2);
     d1.arr = divide_pmfs(d1.arr, d1.len, d2.arr, d2.len, d1.left, d2.left,
                          &d1.left, &d1.len);
+    if (d1.arr == NULL) {
+        return invalid_token();
+    }
     if (d1.len == 1) {
         free(d1.arr);
         d1.type = CONSTANT;
@@ -152,6 +269,7 @@ Token div1D(Token i, Token d) {
     i.type = PMF;
     i.arr = malloc(sizeof(double));
     i.len = 1;
+    i.stride = 1;
     i.arr[0] = 1.0;
     return divDD(i,d);
 }
@@ -174,13 +292,13 @@ Token equD1(Token d, Token i) {
     // Shrinking is handled
     //double* new_arr = malloc(2*sizeof(double));
     double p = 0.0;
-    if (d.left <= i.left && i.left < d.left+d.len) {
+    if (d.left <= i.left && i.left <= T_max(d)) {
         if (d.len == 1) {
             free(d.arr); // certain to be true, demote to integer
             i.left = 1;
             return i;
         }
-        p = d.arr[i.left-d.left];
+        p = T_at(d, i.left);
     } else {
         free(d.arr); // certain to be false, demote to integer
         i.left = 0;
@@ -193,6 +311,7 @@ Token equD1(Token d, Token i) {
     d.arr[0] = 1.0-p;
     d.len = 2;
     d.left = 0;
+    d.stride = 1;
     return d;
 }
 #define equ1D(i,d) equD1(d,i)
@@ -220,7 +339,7 @@ Token equDD(Token d1, Token d2) {
         d1 = d2;
         d2 = temp;
     }
-    if (d2.left >= d1.left+d1.len) {
+    if (d2.left > T_max(d1)) {
         // distributions are disjoint
         free(d1.arr);
         free(d2.arr);
@@ -247,16 +366,15 @@ Token equDD(Token d1, Token d2) {
     double c = 0.0;
     #endif
     for (int64_t i = 0; i < d2.len; i++) {
-        // i is position in d2.arr
-        // j is position in d1.arr
-        int64_t j = i + (d2.left - d1.left);
-        if (j >= d1.len) {
+        // i is position in d2.arr, n is the value there
+        const int64_t n = d2.left + i*d2.stride;
+        if (n > T_max(d1)) {
             break;
         }
         #if LDBL_MANT_DIG == 64
-        sum += d1.arr[j]*d2.arr[i];
+        sum += T_at(d1, n)*d2.arr[i];
         #else
-        double y = d1.arr[j] * d2.arr[i] - c;
+        double y = T_at(d1, n) * d2.arr[i] - c;
         double t = sum + y;
         c = (t-sum)-y;
         sum = t;
@@ -267,6 +385,7 @@ Token equDD(Token d1, Token d2) {
     d1.arr = realloc(d1.arr, 2*sizeof(double));
     d1.len = 2;
     d1.left = 0;
+    d1.stride = 1;
     d1.arr[1] = sum;
     d1.arr[0] = 1.0-sum;
     return d1;
@@ -305,7 +424,7 @@ Token greD1(Token d, Token i) {
     // Shrinking: handled
     // d > i
     double p;
-    int64_t d_index = i.left - d.left;
+    int64_t d_index = T_floor_index(d, i.left);
     if (d_index >= d.len - 1) {
         // i is >= max possible value of d, so always false
         free(d.arr);
@@ -329,6 +448,7 @@ Token greD1(Token d, Token i) {
     d.arr[1] = p;
     d.left = 0;
     d.len = 2;
+    d.stride = 1;
     return d;
 } //     i < d   <->   d > i
 #define les1D(i,d) greD1(d,i)
@@ -336,7 +456,7 @@ Token geqD1(Token d, Token i) {
     // Memory: handled here/by greD1
     // shrinking is handled
     // d >= i
-    if (d.left + d.len <= i.left) {
+    if (T_max(d) < i.left) {
         // all d < i, so always false
         free(d.arr);
         i.left = 0;
@@ -357,6 +477,7 @@ Token geqD1(Token d, Token i) {
         d.arr[0] = 1-d.left;
         d.left = 0;
         d.len = 2;
+        d.stride = 1;
     }
     d.arr[0] -= eq;
     d.arr[1] += eq;
@@ -369,7 +490,8 @@ Token gre1D(Token i, Token d) {
     // Shrinking is handled
     // i > d
     double p;
-    int64_t d_index = i.left - d.left;
+    // number of values of d that are < i
+    int64_t d_index = ceil_div(i.left - d.left, d.stride);
     if (d_index >= d.len) {
         free(d.arr);
         i.left = 1;
@@ -379,15 +501,15 @@ Token gre1D(Token i, Token d) {
         i.left = 0;
         return i;
     } else {
-        p = d.arr[d_index];
         ip_cumsum(d.arr, d.len);
-        p = d.arr[d_index] - p;
+        p = d.arr[d_index-1];
     }
     d.arr = realloc(d.arr, 2*sizeof(double));
     d.arr[0] = 1.0-p;
     d.arr[1] = p;
     d.left = 0;
     d.len = 2;
+    d.stride = 1;
     return d;
 } //     i < d   <->  d > i
 #define lesD1(i,d) gre1D(d,i)
@@ -400,7 +522,7 @@ Token geq1D(Token i, Token d) {
         free(d.arr);
         i.left = 0;
         return i;
-    } else if (i.left >= d.left+d.len-1) {
+    } else if (i.left >= T_max(d)) {
         // i >= all d, so always true
         free(d.arr);
         i.left = 1;
@@ -415,6 +537,7 @@ Token geq1D(Token i, Token d) {
         d.arr[0] = 1-d.left;
         d.left = 0;
         d.len = 2;
+        d.stride = 1;
     }
     d.arr[0] -= eq;
     d.arr[1] += eq;
@@ -426,14 +549,14 @@ Token greDD(Token d1, Token d2) {
     // Memory: d2 is freed, d1 is freed or reallocated + returned
     // Shrinking is handled
     // d1 > d2
-    if (d1.left >= d2.left+d2.len) {
+    if (d1.left > T_max(d2)) {
         // all d1 > all d2, certainly true
         free(d1.arr);
         free(d2.arr);
         d1.type = CONSTANT;
         d1.left = 1;
         return d1;
-    } else if (d1.left+d1.len-1 <= d2.left) {
+    } else if (T_max(d1) <= d2.left) {
         // all d1 <= all d2, certainly false
         free(d1.arr);
         free(d2.arr);
@@ -449,15 +572,16 @@ Token greDD(Token d1, Token d2) {
     double c = 0.0;
     #endif
     ip_cumsum(d1.arr, d1.len);
-    for (int64_t n = d2.left; n < d2.left+d2.len; n++) {
-        if (n >= d1.left+d1.len) {
+    for (int64_t i = 0; i < d2.len; i++) {
+        const int64_t n = d2.left + i*d2.stride;
+        if (n > T_max(d1)) {
             break;
         }
         // P(d1 > d2) = Sum_{n in d2} P(d1>i | d2=n) * P(d2=n) by law of total probability
         #if LDBL_MANT_DIG == 64
-        sum += (1.0-T_at(d1, n)) * d2.arr[n-d2.left];
+        sum += (1.0-T_cdf_at(d1, n)) * d2.arr[i];
         #else
-        double y = (1.0-T_at(d1, n)) * d2.arr[n-d2.left] - c;
+        double y = (1.0-T_cdf_at(d1, n)) * d2.arr[i] - c;
         //double y = (1.0-d1.arr[i1])*d2.arr[i2] - c;
         double t = sum+y;
         c = (t-sum)-y;
@@ -469,6 +593,7 @@ Token greDD(Token d1, Token d2) {
     d1.arr = realloc(d1.arr, 2*sizeof(double));
     d1.len = 2;
     d1.left = 0;
+    d1.stride = 1;
     d1.arr[1] = sum;
     d1.arr[0] = 1.0-sum;
     return d1;
@@ -479,14 +604,14 @@ Token leqDD(Token d1, Token d2) {
     // Memory: d2 is freed, d1 is freed or reallocated + returned
     // Shrinking is handled
     // d1 <= d2
-    if (d1.left >= d2.left+d2.len) {
+    if (d1.left > T_max(d2)) {
         // all d1 > all d2, certainly false
         free(d1.arr);
         free(d2.arr);
         d1.type = CONSTANT;
         d1.left = 0;
         return d1;
-    } else if (d1.left+d1.len-1 <= d2.left) {
+    } else if (T_max(d1) <= d2.left) {
         // all d1 <= all d2, certainly true
         free(d1.arr);
         free(d2.arr);
@@ -502,15 +627,16 @@ Token leqDD(Token d1, Token d2) {
     double c = 0.0;
     #endif
     ip_cumsum(d1.arr, d1.len);
-    for (int64_t n = d2.left; n < d2.left+d2.len; n++) {
-        if (n >= d1.left+d1.len) {
+    for (int64_t i = 0; i < d2.len; i++) {
+        const int64_t n = d2.left + i*d2.stride;
+        if (n > T_max(d1)) {
             break;
         }
         // P(d1 <= d2) = 1-P(d1 > d2) = 1-Sum_{n in d2} P(d1>i | d2=n) * P(d2=n) by law of total probability
         #if LDBL_MANT_DIG == 64
-        sum += (1.0-T_at(d1, n)) * d2.arr[n-d2.left];
+        sum += (1.0-T_cdf_at(d1, n)) * d2.arr[i];
         #else
-        double y = (1.0-T_at(d1, n)) * d2.arr[n-d2.left] - c;
+        double y = (1.0-T_cdf_at(d1, n)) * d2.arr[i] - c;
         double t = sum+y;
         c = (t-sum)-y;
         sum = t;
@@ -521,6 +647,7 @@ Token leqDD(Token d1, Token d2) {
     d1.arr = realloc(d1.arr, 2*sizeof(double));
     d1.len = 2;
     d1.left = 0;
+    d1.stride = 1;
     d1.arr[1] = sum;
     d1.arr[0] = 1.0-sum;
     return d1;
@@ -540,8 +667,9 @@ Token of_1D(Token i, Token d) {
         free(d.arr);
         return i;
     }
+    // Strides: the sum of copies of d has the same stride as d
     if (i.left < 0) {
-        d.left = i.left*(d.left + d.len - 1);
+        d.left = i.left*T_max(d);
     } else {
         d.left = i.left*d.left;
     }
@@ -556,6 +684,9 @@ Token of_1D(Token i, Token d) {
 Token of_DD(Token d1, Token d2) {
     // at_multiply_pmfs manages memory
     // cannot shrink (won't receive distribution that's always 0)
+    // Strides: made dense first
+    d1 = T_dense(d1);
+    d2 = T_dense(d2);
     int64_t upper;
     d1.arr = at_multiply_pmfs(d1.arr, d1.len, d2.arr, d2.len,
                               d1.left, d2.left, &(d1.left), &upper);
@@ -571,11 +702,13 @@ Token mod11(Token x, Token y) {
 }
 
 Token modD1(Token d, Token x) {
+    // Strides: made dense first
     if (x.left == 1 || x.left == -1) {
         free(d.arr);
         x.left = 0;
         return x;
     }
+    d = T_dense(d);
     int64_t min = d.left % x.left;
     int64_t max = d.left % x.left;
     if (d.len < (x.left > 0 ? x.left : -x.left)) {
@@ -602,3 +735,222 @@ Token modD1(Token d, Token x) {
     d.left = min;
     return d;
 }
+
+// ^ operator. Powers are very spread out (1d6^3 goes from 1 to 216 but only
+// takes 6 values), so these work on sparse PMFs (see sparse.c), and the result
+// stays sparse if it's spread out enough.
+
+Token pow11(Token x, Token y) {
+    // stack memory
+    // cannot shrink
+    int error = 0;
+    x.left = int_pow(x.left, y.left, &error);
+    return error ? invalid_token() : x;
+}
+
+/**
+ * Helper function. Converts a token of type PMF, SPARSE or CONSTANT to a
+ * sparse PMF. Doesn't free anything.
+ */
+SparsePMF T_to_sparse(const Token t) {
+    if (t.type == CONSTANT) {
+        double one = 1.0;
+        return dense_to_sparse(&one, 1, t.left, 1);
+    } else if (t.type == SPARSE) {
+        SparsePMF out;
+        out.len = t.len;
+        out.entries = malloc(t.len*sizeof(SparseEntry));
+        for (int64_t i = 0; i < t.len; i++) {
+            out.entries[i].value = t.values[i];
+            out.entries[i].prob = t.arr[i];
+        }
+        return out;
+    }
+    return dense_to_sparse(t.arr, t.len, t.left, t.stride);
+}
+
+/**
+ * Helper function. Makes a token out of a sparse PMF: a CONSTANT if it only
+ * takes one value, a SPARSE if a dense array would be mostly zeros, and a PMF
+ * otherwise. Frees x.
+ *
+ * \param[in] x Normalized sparse PMF with at least one entry
+ */
+Token T_from_sparse(SparsePMF x) {
+    Token out = invalid_token();
+    out.left = x.entries[0].value;
+    if (x.len == 1) {
+        free(x.entries);
+        out.type = CONSTANT;
+        return out;
+    }
+    int64_t stride;
+    const int64_t dense_len = sparse_dense_len(x, &stride);
+    if (dense_len != -1 && dense_len <= SPARSE_MIN_SPREAD*x.len) {
+        out.type = PMF;
+        out.arr = sparse_to_dense(x, &(out.left), &(out.len), &(out.stride));
+        return out;
+    }
+    out.type = SPARSE;
+    out.len = x.len;
+    out.arr = malloc(x.len*sizeof(double));
+    out.values = malloc(x.len*sizeof(int64_t));
+    for (int64_t i = 0; i < x.len; i++) {
+        out.values[i] = x.entries[i].value;
+        out.arr[i] = x.entries[i].prob;
+    }
+    free(x.entries);
+    return out;
+}
+
+/**
+ * Helper function. Converts a SPARSE token to a PMF, for code that only knows
+ * about dense arrays. Does nothing to other tokens. Fails if the array would
+ * be too big.
+ *
+ * \return t as a PMF, or invalid_token() (after freeing t) if it failed
+ */
+Token T_unsparse(Token t) {
+    if (t.type != SPARSE) {
+        return t;
+    }
+    SparsePMF x = T_to_sparse(t);
+    free_token(t);
+    t.type = PMF;
+    t.values = NULL;
+    t.arr = sparse_to_dense(x, &(t.left), &(t.len), &(t.stride));
+    return (t.arr == NULL) ? invalid_token() : t;
+}
+
+Token powTT(Token x, Token y) {
+    // Memory: frees whichever of x's and y's arrays exist, returns new ones
+    // Shrinking is handled (eg 1d2^0 is always 1)
+    SparsePMF base = T_to_sparse(x);
+    SparsePMF exponent = T_to_sparse(y);
+    free_token(x);
+    free_token(y);
+    SparsePMF result = sparse_pow(base, exponent);
+    free(base.entries);
+    free(exponent.entries);
+    if (result.entries == NULL) {
+        return invalid_token();
+    }
+    return T_from_sparse(result);
+}
+
+/**
+ * Works out x (op) y one pair of values at a time, see sparse_combine. Used
+ * when one of them is SPARSE and there aren't too many pairs.
+ */
+Token sparse_arithTT(const char op, Token x, Token y) {
+    // Memory: frees whichever of x's and y's arrays exist, returns new ones
+    // Shrinking is handled
+    SparsePMF a = T_to_sparse(x);
+    SparsePMF b = T_to_sparse(y);
+    free_token(x);
+    free_token(y);
+    SparsePMF result = sparse_combine(a, b, op);
+    free(a.entries);
+    free(b.entries);
+    if (result.entries == NULL) {
+        return invalid_token();
+    }
+    return T_from_sparse(result);
+}
+
+/**
+ * \return 1 if x (op) y should be worked out with sparse_arithTT
+ */
+int use_sparse_arith(const char op, const Token x, const Token y) {
+    if (x.type != SPARSE && y.type != SPARSE) {
+        return 0;
+    }
+    switch (op) {
+    case OP_ADD: case OP_SUB: case OP_MUL:
+    case OP_GRE: case OP_LES: case OP_GEQ:
+    case OP_LEQ: case OP_EQU: case OP_NEQ:
+        break;
+    default:
+        return 0;
+    }
+    const int64_t x_len = (x.type == CONSTANT) ? 1 : x.len;
+    const int64_t y_len = (y.type == CONSTANT) ? 1 : y.len;
+    return x_len <= SPARSE_MAX_PAIRS/y_len;
+}
+
+#define powD1(x,y) powTT(x,y)
+#define pow1D(x,y) powTT(x,y)
+#define powDD(x,y) powTT(x,y)
+
+// Tail pruning. Things like 1000d1000*3d6 have long tails of entries below
+// 1e-300, which every later operation has to drag along. If prune_budget is
+// positive, we cut off the smallest entries at either end of every result, as
+// long as the total probability thrown away over the whole expression stays
+// at most prune_budget. Set by the environment variable DICE_PRUNE.
+// The probability thrown away so far in the current expression is
+// CTX->pruned_mass.
+double prune_budget = 0.0;
+
+/**
+ * Sets prune_budget from the environment variable DICE_PRUNE, if it's set.
+ */
+void init_prune_budget() {
+    const char* env = getenv("DICE_PRUNE");
+    if (env == NULL) {
+        return;
+    }
+    char* end;
+    double val = strtod(env, &end);
+    if (end != env && *end == '\0' && val >= 0.0 && val < 1.0) {
+        prune_budget = val;
+    }
+}
+
+/**
+ * Trims both tails of d while staying within what's left of prune_budget,
+ * always cutting whichever end is smaller first.
+ *
+ * \param d Token of any type
+ * \return d, possibly shorter (or demoted to CONSTANT)
+ */
+Token T_prune(Token d) {
+    // Memory: reallocated + returned, or freed if it shrinks to one entry
+    if ((d.type != PMF && d.type != SPARSE) || prune_budget <= 0.0) {
+        return d;
+    }
+    double remaining = prune_budget - CTX->pruned_mass;
+    int64_t lo = 0;
+    int64_t hi = d.len-1;
+    while (lo < hi) {
+        const int lower = d.arr[lo] <= d.arr[hi];
+        const double p = lower ? d.arr[lo] : d.arr[hi];
+        if (p > remaining) {
+            break;
+        }
+        remaining -= p;
+        CTX->pruned_mass += p;
+        if (lower) {
+            lo++;
+        } else {
+            hi--;
+        }
+    }
+    if (lo == 0 && hi == d.len-1) {
+        return d;
+    }
+    d.len = hi - lo + 1;
+    d.left = (d.type == SPARSE) ? d.values[lo] : d.left + lo*d.stride;
+    if (d.len == 1) {
+        free_token(d);
+        d.type = CONSTANT;
+        return d;
+    }
+    memmove(d.arr, d.arr+lo, d.len*sizeof(double));
+    d.arr = realloc(d.arr, d.len*sizeof(double));
+    if (d.type == SPARSE) {
+        memmove(d.values, d.values+lo, d.len*sizeof(int64_t));
+        d.values = realloc(d.values, d.len*sizeof(int64_t));
+    }
+    return d;
+}
+#endif
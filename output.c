@@ -0,0 +1,254 @@
+#ifndef OUTPUT_C
+#define OUTPUT_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "defs.c"
+
+// This file prints results as numbers instead of as a plot, for when the
+// output is going into another program. The environment variable DICE_OUTPUT
+// picks the format:
+//   plot (default): the ASCII art from plot.c
+//   csv: lines starting with # hold left, len, stride, mean, standard
+//        deviation and pruned, then there's a header and one "value,pmf,cdf"
+//        line per entry of the PMF
+//   json: one object with left, len, stride, mean, stdev, pruned, and arrays
+//         pmf and cdf
+//   binary: the 8 bytes "DICEPMF\0", then int64 left, len and stride, then
+//           double mean, stdev and pruned, then len doubles of PMF and len
+//           doubles of CDF, all little-endian
+// pruned is the probability that DICE_PRUNE cut off the tails, 0 if nothing
+// was. Entry k of the PMF is the probability of left + k*stride. Sparse results
+// (see sparse.c) have stride 0 instead, and list the value of each entry: in
+// the value column for csv, in an array "values" for json, and as len int64s
+// after the CDF for binary. Formatting is done in parallel into one buffer,
+// which is then written all at once.
+
+#define OUTPUT_PLOT 0
+#define OUTPUT_CSV 1
+#define OUTPUT_JSON 2
+#define OUTPUT_BINARY 3
+
+// Entries per chunk when formatting text in parallel
+#define OUTPUT_CHUNK_LEN 65536
+// Enough characters for "%.17g" of any double, or "%ld" of any int64
+#define OUTPUT_DOUBLE_LEN 32
+
+// Which array format_chunk formats for JSON
+#define PART_PMF 0
+#define PART_CDF 1
+#define PART_VALUES 2
+
+int output_mode = OUTPUT_PLOT;
+
+/**
+ * Reads the output format from the environment variable DICE_OUTPUT. Unknown
+ * formats are reported and ignored.
+ */
+void init_output_mode() {
+    const char* env = getenv("DICE_OUTPUT");
+    if (env == NULL || *env == '\0' || !strcmp(env, "plot")) {
+        output_mode = OUTPUT_PLOT;
+    } else if (!strcmp(env, "csv")) {
+        output_mode = OUTPUT_CSV;
+    } else if (!strcmp(env, "json")) {
+        output_mode = OUTPUT_JSON;
+    } else if (!strcmp(env, "binary")) {
+        output_mode = OUTPUT_BINARY;
+    } else {
+        fprintf(stderr, "Unknown DICE_OUTPUT \"%s\", using plot\n", env);
+        output_mode = OUTPUT_PLOT;
+    }
+}
+
+/**
+ * \return The value whose probability is entry i of a PMF, see output_pmf
+ */
+int64_t pmf_value(const int64_t* values, const int64_t left,
+                  const int64_t stride, const int64_t i) {
+    return (values != NULL) ? values[i] : left + i*stride;
+}
+
+/**
+ * Works out the CDF and summary stats of a PMF in one pass.
+ *
+ * \param[in] pmf PMF, pmf[k] is the probability of left + k*stride, or of
+ * values[k] if values isn't NULL
+ * \param[out] cdf Place to put the CDF, same length as pmf
+ * \param[out] mean Location to store the expected value
+ * \param[out] stdev Location to store the standard deviation
+ */
+void pmf_summary(const double* pmf, const int64_t* values, const int64_t len,
+                 const int64_t left, const int64_t stride, double* cdf,
+                 double* mean, double* stdev) {
+    double mu, s, weight_sum;
+    mu = s = weight_sum = 0.0;
+    for (int64_t i = 0; i < len; i++) {
+        const double weight = pmf[i];
+        if (weight != 0.0) {
+            const double x = (double)pmf_value(values, left, stride, i);
+            weight_sum += weight;
+            const double old_mu = mu;
+            mu += (weight / weight_sum) * (x - old_mu);
+            s += weight * (x - old_mu) * (x - mu);
+        }
+        cdf[i] = weight_sum;
+    }
+    *mean = mu;
+    *stdev = (weight_sum > 0.0) ? sqrt(s/weight_sum) : 0.0;
+}
+
+/**
+ * Formats entries [begin, end) of the PMF and CDF as text.
+ *
+ * \param[out] buf Place to put the text, big enough for
+ * (end-begin)*(2*OUTPUT_DOUBLE_LEN+2) characters for JSON, or
+ * (end-begin)*(3*OUTPUT_DOUBLE_LEN+3) for CSV
+ * \param part For JSON, PART_PMF, PART_CDF or PART_VALUES
+ * \return Number of characters written
+ */
+size_t format_chunk(char* buf, const double* pmf, const int64_t* values,
+                    const double* cdf, const int64_t begin, const int64_t end,
+                    const int64_t left, const int64_t stride, const int part) {
+    char* pos = buf;
+    for (int64_t i = begin; i < end; i++) {
+        if (output_mode == OUTPUT_CSV) {
+            pos += sprintf(pos, "%ld,%.17g,%.17g\n",
+                           pmf_value(values, left, stride, i), pmf[i], cdf[i]);
+        } else if (part == PART_VALUES) {
+            pos += sprintf(pos, (i == 0) ? "%ld" : ",%ld", values[i]);
+        } else {
+            pos += sprintf(pos, (i == 0) ? "%.17g" : ",%.17g",
+                           (part == PART_CDF) ? cdf[i] : pmf[i]);
+        }
+    }
+    return pos - buf;
+}
+
+/**
+ * Formats every entry of the PMF (or the CDF, or the values) in parallel and
+ * appends the text to out.
+ *
+ * \return New length of out
+ */
+size_t format_entries(char* out, size_t out_len, const double* pmf,
+                      const int64_t* values, const double* cdf,
+                      const int64_t len, const int64_t left,
+                      const int64_t stride, const int part) {
+    const int64_t num_chunks = (len + OUTPUT_CHUNK_LEN - 1)/OUTPUT_CHUNK_LEN;
+    const size_t row_len = (output_mode == OUTPUT_CSV) ? 3*OUTPUT_DOUBLE_LEN+3
+                                                       : 2*OUTPUT_DOUBLE_LEN+2;
+    char** chunks = malloc(num_chunks*sizeof(char*));
+    size_t* chunk_lens = malloc(num_chunks*sizeof(size_t));
+    #pragma omp parallel for if (num_chunks > 1)
+    for (int64_t c = 0; c < num_chunks; c++) {
+        const int64_t begin = c*OUTPUT_CHUNK_LEN;
+        const int64_t end = (begin + OUTPUT_CHUNK_LEN < len) ? begin + OUTPUT_CHUNK_LEN : len;
+        chunks[c] = malloc((end-begin)*row_len);
+        chunk_lens[c] = format_chunk(chunks[c], pmf, values, cdf, begin, end,
+                                     left, stride, part);
+    }
+    for (int64_t c = 0; c < num_chunks; c++) {
+        memcpy(out + out_len, chunks[c], chunk_lens[c]);
+        out_len += chunk_lens[c];
+        free(chunks[c]);
+    }
+    free(chunks);
+    free(chunk_lens);
+    return out_len;
+}
+
+/**
+ * Copies n 8-byte values to buf in little-endian order.
+ */
+void put_le64(char* buf, const void* values, const int64_t n) {
+    const uint16_t one = 1;
+    memcpy(buf, values, 8*n);
+    if (*(const char*)&one) {
+        return;
+    }
+    for (int64_t i = 0; i < n; i++) {
+        for (int j = 0; j < 4; j++) {
+            const char temp = buf[8*i+j];
+            buf[8*i+j] = buf[8*i+7-j];
+            buf[8*i+7-j] = temp;
+        }
+    }
+}
+
+/**
+ * Prints a PMF to standard out in the format picked by DICE_OUTPUT, with a
+ * single write.
+ *
+ * \param[in] pmf PMF, pmf[k] is the probability of left + k*stride
+ * \param[in] values NULL, or for sparse PMFs, pmf[k] is the probability of
+ * values[k] instead (and left and stride are ignored)
+ * \param pruned Probability that was cut off the tails while working it out
+ */
+void output_pmf(const double* pmf, const int64_t* values, const int64_t len,
+                int64_t left, int64_t stride, const double pruned) {
+    if (values != NULL) {
+        left = values[0];
+        stride = 0;
+    }
+    double* cdf = malloc(len*sizeof(double));
+    double mean, stdev;
+    pmf_summary(pmf, values, len, left, stride, cdf, &mean, &stdev);
+    size_t size;
+    if (output_mode == OUTPUT_BINARY) {
+        size = 8 + 6*8 + (values != NULL ? 3 : 2)*len*8;
+    } else if (output_mode == OUTPUT_CSV) {
+        size = 256 + len*(3*OUTPUT_DOUBLE_LEN+3);
+    } else {
+        size = 256 + len*3*(OUTPUT_DOUBLE_LEN+1);
+    }
+    char* buf = malloc(size);
+    size_t n = 0;
+    if (output_mode == OUTPUT_BINARY) {
+        const int64_t ints[3] = {left, len, stride};
+        const double stats[3] = {mean, stdev, pruned};
+        memcpy(buf, "DICEPMF\0", 8);
+        put_le64(buf + 8, ints, 3);
+        put_le64(buf + 32, stats, 3);
+        put_le64(buf + 56, pmf, len);
+        put_le64(buf + 56 + 8*len, cdf, len);
+        if (values != NULL) {
+            put_le64(buf + 56 + 16*len, values, len);
+        }
+        n = size;
+    #ifdef _WIN32
+        _setmode(_fileno(OUT_STREAM), _O_BINARY);
+    #endif
+    } else if (output_mode == OUTPUT_CSV) {
+        n += sprintf(buf, "# left=%ld\n# len=%ld\n# stride=%ld\n# mean=%.17g\n"
+                     "# stdev=%.17g\n# pruned=%.17g\nvalue,pmf,cdf\n", left, len,
+                     stride, mean, stdev, pruned);
+        n = format_entries(buf, n, pmf, values, cdf, len, left, stride, PART_PMF);
+    } else {
+        n += sprintf(buf, "{\"left\":%ld,\"len\":%ld,\"stride\":%ld,"
+                     "\"mean\":%.17g,\"stdev\":%.17g,\"pruned\":%.17g,\"pmf\":[",
+                     left, len, stride, mean, stdev, pruned);
+        n = format_entries(buf, n, pmf, values, cdf, len, left, stride, PART_PMF);
+        n += sprintf(buf + n, "],\"cdf\":[");
+        n = format_entries(buf, n, pmf, values, cdf, len, left, stride, PART_CDF);
+        if (values != NULL) {
+            n += sprintf(buf + n, "],\"values\":[");
+            n = format_entries(buf, n, pmf, values, cdf, len, left, stride,
+                               PART_VALUES);
+        }
+        n += sprintf(buf + n, "]}\n");
+    }
+    fwrite(buf, 1, n, OUT_STREAM);
+    fflush(OUT_STREAM);
+    free(buf);
+    free(cdf);
+}
+
+#endif
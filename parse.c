@@ -14,7 +14,7 @@
  * 
  * \param[in] input Input string
  * \param len Length of input
- * \return The number of tokens parsed
+ * \return The number of tokens parsed, or -1 if there are too many
  */
 int split_tokens(const char input[], const int len) {
     debug("split_tokens(\"%s\")\n", input);
@@ -25,12 +25,11 @@ int split_tokens(const char input[], const int len) {
         if (input_is_operator(x) || x == '(' || x == ')' || x == ',') {
             if (token_i == 0) {
                 if (token >= MAX_TOKENS) {
-                    fprintf(stderr, "Input too big (More than %d tokens).\n", MAX_TOKENS);
-                    Exit(1);
+                    fprintf(ERR_STREAM, "Input too big (More than %d tokens).\n", MAX_TOKENS);
                     return -1;
                 }
                 if (x == ',') {
-                    // fprintf(stderr, "Cannot start input with a comma\n");
+                    // fprintf(ERR_STREAM, "Cannot start input with a comma\n");
                     // Exit(1);
                     // return -1;
                 }
@@ -39,8 +38,7 @@ int split_tokens(const char input[], const int len) {
                 token++;
             } else {
                 if (token >= MAX_TOKENS-1) {
-                    fprintf(stderr, "Input too big (More than %d tokens).\n", MAX_TOKENS);
-                    Exit(1);
+                    fprintf(ERR_STREAM, "Input too big (More than %d tokens).\n", MAX_TOKENS);
                     return -1;
                 }
                 //PARSE_BUF[token][token_i+1] = '\0'; // I think this line causes quiet failures.
@@ -57,6 +55,10 @@ int split_tokens(const char input[], const int len) {
             // add current thing
             // set prev=i+1;
         } else {
+            if (x == ' ' && token_i == 0) {
+                // otherwise the space in "keep(1d6, 4, -2)" would be a token
+                continue;
+            }
             if (token_i >= TOKEN_LEN-1) {
                 return -1;
             }
@@ -74,7 +76,8 @@ int split_tokens(const char input[], const int len) {
  * Converts a string into a token representing that string.
  * 
  * \param input String
- * \return Token representing that string
+ * \return Token representing that string, or invalid_token() if it doesn't
+ * make sense
  */
 Token str_to_token(const char input[]) {
     // input: a null-terminated string that's either an operator,
@@ -82,6 +85,8 @@ Token str_to_token(const char input[]) {
     // or something in the form "%dd%d"
     Token out;
     out.left = out.right = 0; // so GCC shuts up
+    out.stride = 1;
+    out.values = NULL;
     while (*input == ' ') {
         input++;
     }
@@ -94,25 +99,25 @@ Token str_to_token(const char input[]) {
     int offset;
     if (!isdigit(input[0])) {
         return choose_func(input);
-        //fprintf(stderr, "Invalid input (type 1).\n");
+        //fprintf(ERR_STREAM, "Invalid input (type 1).\n");
         //Exit(1);
     }
     sscanf(input, "%ld%n", &(out.left), &offset);
     if (offset > 10) {
-        fprintf(stderr, "Number too big.\n");
-        Exit(1);
+        fprintf(ERR_STREAM, "Number too big.\n");
+        return invalid_token();
     }
     if (input[offset] == 'd') {
         int count;
         if (!isdigit(input[offset+1])) {
-            fprintf(stderr, "Invalid input (type 2).\n");
-            Exit(1);
+            fprintf(ERR_STREAM, "Invalid input (type 2).\n");
+            return invalid_token();
         }
         sscanf(input+offset+1, "%ld%n", &(out.right), &count);
         debug("after \"end\" of token: \"%c\"\n", input[offset+1+count]);
         if (count > 10) {
-            fprintf(stderr, "Number too big.\n");
-            Exit(1);
+            fprintf(ERR_STREAM, "Number too big.\n");
+            return invalid_token();
         }
         if (out.left == 0 || out.right == 0) {
             out.type = CONSTANT;
@@ -129,8 +134,8 @@ Token str_to_token(const char input[]) {
                         sscanf(input+offset+3+count, "%ld", &dropper_val);
                     }
                 } else {
-                    fprintf(stderr, "Invalid input (in dropping handler).\n");
-                    Exit(1);
+                    fprintf(ERR_STREAM, "Invalid input (in dropping handler).\n");
+                    return invalid_token();
                 }
                 if (first_char == 'd') {
                     dropper_val = out.left - dropper_val;
@@ -154,42 +159,40 @@ Token str_to_token(const char input[]) {
             offset++;
         }
         if (strlen(input+offset) > 0) {
-            fprintf(stderr, "Invalid input (type 3).\n");
-            Exit(1);
+            fprintf(ERR_STREAM, "Invalid input (type 3).\n");
+            return invalid_token();
         }
     }
     return out;
     //scanf("%id%i", input, &(out.left), &(out.right));
 }
 
-#define PAREN_STACK_SIZE 1024
-int paren_stack[PAREN_STACK_SIZE];
-int paren_stack_i = 0;
 
 int str_stack_push(int n) {
-    if (paren_stack_i == PAREN_STACK_SIZE) {
+    if (CTX->paren_stack_i == PAREN_STACK_SIZE) {
         return -1;
     }
-    paren_stack[paren_stack_i++] = n;
+    CTX->paren_stack[CTX->paren_stack_i++] = n;
     return 0;
 }
 
 int str_stack_peek() {
-    if (paren_stack_i > 0) {
-        return paren_stack[paren_stack_i-1];
+    if (CTX->paren_stack_i > 0) {
+        return CTX->paren_stack[CTX->paren_stack_i-1];
     }
     return -1;
 }
 
 void str_stack_discard_top() {
     // we only call this after a call to str_stack_peek, so no need to check
-    paren_stack_i--;
+    CTX->paren_stack_i--;
 }
 
 int reformat_functions(const int argc, char const* argv[], char* out) {
     int paren_depth = 0;
     int prev_is_alpha = 0;
     int n = 0;
+    CTX->paren_stack_i = 0; // might be left over from input that didn't parse
     for (int i = 1; i < argc; i++) {
         for (int j = 0; argv[i][j] != '\0'; j++) {
             // either letter, comma, (, or )
@@ -246,7 +249,7 @@ int reformat_functions(const int argc, char const* argv[], char* out) {
  * 
  * \param argc - argc as passed to main
  * \param argv - argv as passed to main
- * \return Returns the number of tokens parsed
+ * \return Returns the number of tokens parsed, or -1 if the input is invalid
  */
 int parse_token_main(const int argc, char const* argv[]) {
     // split at arithmetic expressions
@@ -266,12 +269,18 @@ int parse_token_main(const int argc, char const* argv[]) {
     }
     debug("INPUT_BUF: %s\n", INPUT_BUF);
     int num_tokens = split_tokens(INPUT_BUF, n);
+    if (num_tokens == -1) {
+        return -1;
+    }
     int j = 0;
     int possible_unary = 1;
     int num_tokens_parsed = num_tokens;
     for (int i = 0; i < num_tokens; i++) {
         // printf("i: %d j: %d %s\n", i, j, PARSE_BUF[i]);
         TOKEN_BUF[j++] = str_to_token(PARSE_BUF[i]);
+        if (TOKEN_BUF[j-1].type == INVALID) {
+            return -1;
+        }
         if (j > 1 && TOKEN_BUF[j-1].type == OP_EQU) {
             // Things like ">=" are parsed as ">" "=", so if we encounter "=" right after
             // ">", we want to replace the ">" with "g" and decrement j.
@@ -1,13 +1,18 @@
 #include "defs.c"
 #include "operators.c"
 #include "functions.c"
+#include "result_cache.c"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // This file handles order of operations and makes sure that the correct
 // functions are applied in the correct order.
 
-Token stack[128]; // RPN stack
-Token queue[128]; // Queue used to convert to RPN
+// The RPN stack and queue are CTX->stack and CTX->queue.
 
 /**
  * Returns operator precedence, such that if the precedence of x is greater
@@ -33,6 +38,17 @@ int precedence(const Token t) {
     return 0;
 }
 
+/**
+ * Frees the operands of an operator that can't be applied to them.
+ *
+ * \return invalid_token()
+ */
+Token discard_operands(const Token x, const Token y) {
+    free_token(x);
+    free_token(y);
+    return invalid_token();
+}
+
 Token addT(Token x, Token y) {
     if (x.type == PMF && y.type == CONSTANT) {
         return addD1(x, y);
@@ -44,9 +60,8 @@ Token addT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return addDD(x, y);
     }
-    fprintf(stderr, "addT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "addT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token subT(Token x, Token y) {
@@ -58,9 +73,8 @@ Token subT(Token x, Token y) {
     } else if (x.type == CONSTANT && y.type == PMF) {
         return sub1D(x, y);
     }
-    fprintf(stderr, "subT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "subT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token mulT(Token x, Token y) {
@@ -74,23 +88,22 @@ Token mulT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return mulDD(x, y);
     }
-    fprintf(stderr, "mulT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "mulT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token divT(Token x, Token y) {
     if (x.type == CONSTANT && y.type == CONSTANT) {
         if (y.left == 0) {
-            fprintf(stderr, "Cannot divide by zero\n");
-            Exit(1);
+            fprintf(ERR_STREAM, "Cannot divide by zero\n");
+            return discard_operands(x, y);
         }
         x.left /= y.left;
         return x;
     } else if (x.type == PMF && y.type == CONSTANT) {
         if (y.left == 0) {
-            fprintf(stderr, "Cannot divide by zero\n");
-            Exit(1);
+            fprintf(ERR_STREAM, "Cannot divide by zero\n");
+            return discard_operands(x, y);
         }
         return divD1(x, y);
     } else if (x.type == CONSTANT && y.type == PMF) {
@@ -98,9 +111,8 @@ Token divT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return divDD(x, y);
     }
-    fprintf(stderr, "divT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "divT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token equT(Token x, Token y) {
@@ -113,9 +125,8 @@ Token equT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return equDD(x, y);
     }
-    fprintf(stderr, "equT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "equT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token neqT(Token x, Token y) {
@@ -128,9 +139,8 @@ Token neqT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return neqDD(x, y);
     }
-    fprintf(stderr, "neqT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x; 
+    fprintf(ERR_STREAM, "neqT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token greT(Token x, Token y) {
@@ -143,9 +153,8 @@ Token greT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return greDD(x, y);
     }
-    fprintf(stderr, "greT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "greT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token lesT(Token x, Token y) {
@@ -158,9 +167,8 @@ Token lesT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return lesDD(x, y);
     }
-    fprintf(stderr, "lesT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "lesT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token geqT(Token x, Token y) {
@@ -173,9 +181,8 @@ Token geqT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return geqDD(x, y);
     }
-    fprintf(stderr, "geqT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "geqT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token leqT(Token x, Token y) {
@@ -188,9 +195,8 @@ Token leqT(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return leqDD(x, y);
     }
-    fprintf(stderr, "leqT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "leqT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token of_T(Token x, Token y) {
@@ -204,9 +210,24 @@ Token of_T(Token x, Token y) {
     } else if (x.type == PMF && y.type == PMF) {
         return of_DD(x,y);
     }
-    fprintf(stderr, "of_T not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "of_T not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
+}
+
+Token powT(Token x, Token y) {
+    if (x.type == CONSTANT && y.type == CONSTANT) {
+        return pow11(x, y);
+    } else if (x.type == SPARSE || y.type == SPARSE) {
+        return powTT(x, y);
+    } else if (x.type == PMF && y.type == CONSTANT) {
+        return powD1(x, y);
+    } else if (x.type == CONSTANT && y.type == PMF) {
+        return pow1D(x, y);
+    } else if (x.type == PMF && y.type == PMF) {
+        return powDD(x, y);
+    }
+    fprintf(ERR_STREAM, "powT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
 }
 
 Token modT(Token x, Token y) {
@@ -221,12 +242,11 @@ Token modT(Token x, Token y) {
         }
         return modD1(x,y);
     }
-    fprintf(stderr, "modT not implemented for %c and %c\n", x.type, y.type);
-    Exit(1);
+    fprintf(ERR_STREAM, "modT not implemented for %c and %c\n", x.type, y.type);
+    return discard_operands(x, y);
     modby0:
-    fprintf(stderr, "Cannot do modulo 0\n");
-    Exit(1);
-    return x;
+    fprintf(ERR_STREAM, "Cannot do modulo 0\n");
+    return discard_operands(x, y);
 }
 
 /**
@@ -239,9 +259,12 @@ Token modT(Token x, Token y) {
  * 
  * \param[in] tokens Array of Token structs, in "standard" (infix) notation
  * \param num_tokens Length of tokens
- * \return Returns the number of tokens placed in the RPN queue.
+ * \return Returns the number of tokens placed in the RPN queue, or -1 if the
+ * parentheses don't match
  */
 int shunting_yard(const Token tokens[], const int num_tokens) {
+    Token* stack = CTX->stack;
+    Token* queue = CTX->queue;
     int q = 0;
     int s = 0;
     Token t;
@@ -254,7 +277,9 @@ int shunting_yard(const Token tokens[], const int num_tokens) {
         } else if (is_operator(t)) { // operator
             while (
                 (s>0) && is_operator(stack[s-1]) && (stack[s-1].type != '(')
-                && (precedence(stack[s-1]) >= precedence(t)) // all ops are left-assoc
+                && ((precedence(stack[s-1]) > precedence(t))
+                    // ^ is right-assoc (2^3^2 is 2^9), everything else is left-assoc
+                    || (precedence(stack[s-1]) == precedence(t) && t.type != OP_POW))
             ) {
                 queue[q++] = stack[--s];
             }
@@ -262,82 +287,817 @@ int shunting_yard(const Token tokens[], const int num_tokens) {
         } else if (t.type == '(') {
             stack[s++] = t;
         } else if (t.type == ')') {
-            while (stack[s-1].type != '(') {
-                // assert stack is not empty (optional)
+            while (s == 0 || stack[s-1].type != '(') {
                 if (s == 0) {
-                    fprintf(stderr, "Mismatched parentheses!\n");
-                    goto error;
+                    fprintf(ERR_STREAM, "Mismatched parentheses!\n");
+                    return -1;
                 }
                 queue[q++] = stack[--s];
             }
             s--;
         } else { // error
-            fprintf(stderr, "Invalid type '%c'\n", t.type);
-            goto error;
+            fprintf(ERR_STREAM, "Invalid type '%c'\n", t.type);
+            return -1;
         }
     }
     while (s > 0) {
         queue[q++] = stack[--s];
     }
     return q;
-    error:
-    Exit(1);
-    return q;
+}
+
+// Results of subexpressions (like the 3d6+2 in (3d6+2)*(3d6+2), or a 10d10
+// that gets typed on every line in interactive mode) are kept in a small
+// memo, keyed by the subexpression's canonical text (and a hash of it to find
+// it quickly), so we don't work them out twice. Same eviction scheme as the
+// rfft plan cache.
+// Maximum number of results we keep at once
+#define EXPR_MEMO_SIZE 64
+// Maximum memory used by the arrays of cached results, in bytes
+#define EXPR_MEMO_MAX_BYTES (64LL*1024*1024)
+
+typedef struct ExprMemoEntry {
+    uint64_t hash;
+    char* text; // canonical text, belongs to the memo
+    Token value; // value's arrays belong to the memo
+    double pruned; // probability pruned while working out value
+    size_t bytes;
+    uint64_t last_used; // 0 means this slot is empty
+} ExprMemoEntry;
+
+typedef struct ExprMemo {
+    ExprMemoEntry entries[EXPR_MEMO_SIZE];
+    size_t bytes;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} ExprMemo;
+
+/**
+ * \return The current context's memo, which is made the first time it's
+ * needed
+ */
+ExprMemo* get_expr_memo() {
+    if (CTX->expr_memo == NULL) {
+        CTX->expr_memo = calloc(1, sizeof(ExprMemo));
+    }
+    return CTX->expr_memo;
+}
+
+/**
+ * Mixes v into the hash h (splitmix64 finalizer).
+ */
+uint64_t hash_mix(uint64_t h, const uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/**
+ * Frees the result in the given memo slot and marks the slot as empty.
+ *
+ * \param i Index into memo->entries
+ */
+void evict_expr_memo(ExprMemo* memo, const int i) {
+    free_token(memo->entries[i].value);
+    free(memo->entries[i].text);
+    memo->entries[i].text = NULL;
+    memo->bytes -= memo->entries[i].bytes;
+    memo->entries[i].bytes = 0;
+    memo->entries[i].last_used = 0;
+}
+
+/**
+ * Looks up a subexpression in the memo.
+ *
+ * \param hash Structural hash of the subexpression
+ * \param text Canonical text of the subexpression, or NULL if it didn't fit
+ * \param max_pruned Most probability the result may have had pruned, so that
+ * using it doesn't go over what's left of prune_budget
+ * \param[out] out Place to store a copy of the result, if we have it
+ * \return 1 if we had it, 0 otherwise
+ */
+int expr_memo_find(const uint64_t hash, const char* text,
+                   const double max_pruned, Token* out) {
+    if (text == NULL) {
+        return 0;
+    }
+    ExprMemo* memo = get_expr_memo();
+    for (int i = 0; i < EXPR_MEMO_SIZE; i++) {
+        ExprMemoEntry* entry = &memo->entries[i];
+        if (entry->last_used != 0 && entry->hash == hash
+                && strcmp(entry->text, text) == 0) {
+            if (entry->pruned > max_pruned) {
+                return 0;
+            }
+            entry->last_used = ++memo->clock;
+            memo->hits++;
+            *out = copy_token(entry->value);
+            CTX->pruned_mass += entry->pruned;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stores a copy of a freshly computed result in the memo, evicting the least
+ * recently used results if needed. Results bigger than the whole budget
+ * aren't stored.
+ *
+ * \param hash Structural hash of the subexpression
+ * \param text Canonical text of the subexpression, or NULL if it didn't fit
+ * \param t The result
+ * \param pruned Probability pruned while working out t
+ */
+void expr_memo_insert(const uint64_t hash, const char* text, const Token t,
+                      const double pruned) {
+    ExprMemo* memo = get_expr_memo();
+    memo->misses++;
+    size_t bytes = 0;
+    if (t.type == PMF) {
+        bytes = t.len*sizeof(double);
+    } else if (t.type == SPARSE) {
+        bytes = t.len*(sizeof(double) + sizeof(int64_t));
+    }
+    if (text == NULL || bytes > EXPR_MEMO_MAX_BYTES) {
+        return;
+    }
+    int empty = -1;
+    for (int i = 0; i < EXPR_MEMO_SIZE; i++) {
+        if (memo->entries[i].last_used == 0) {
+            empty = i;
+        }
+    }
+    while (empty == -1 || memo->bytes + bytes > EXPR_MEMO_MAX_BYTES) {
+        int oldest = -1;
+        for (int i = 0; i < EXPR_MEMO_SIZE; i++) {
+            if (memo->entries[i].last_used != 0 && (oldest == -1
+                    || memo->entries[i].last_used < memo->entries[oldest].last_used)) {
+                oldest = i;
+            }
+        }
+        evict_expr_memo(memo, oldest);
+        empty = oldest;
+    }
+    ExprMemoEntry* entry = &memo->entries[empty];
+    entry->hash = hash;
+    entry->text = malloc(strlen(text)+1);
+    strcpy(entry->text, text);
+    entry->value = copy_token(t);
+    entry->pruned = pruned;
+    entry->bytes = bytes;
+    entry->last_used = ++memo->clock;
+    memo->bytes += bytes;
+}
+
+/**
+ * Empties a memo.
+ */
+void clear_expr_memo(ExprMemo* memo) {
+    for (int i = 0; i < EXPR_MEMO_SIZE; i++) {
+        if (memo->entries[i].last_used != 0) {
+            evict_expr_memo(memo, i);
+        }
+    }
+}
+
+/**
+ * Writes the canonical text of the subexpression ending with token t to buf,
+ * as RPN with the text of its arguments in args. This is the key used by the
+ * result cache file.
+ *
+ * \return Number of characters written, or -1 if it doesn't fit
+ */
+int write_canonical_text(char* buf, const int size, const Token t,
+                         const char** args, const int num_args) {
+    int n = 0;
+    for (int k = 0; k < num_args; k++) {
+        if (args[k] == NULL) {
+            return -1;
+        }
+        const int len = snprintf(buf+n, size-n, "%s ", args[k]);
+        if (len < 0 || len >= size-n) {
+            return -1;
+        }
+        n += len;
+    }
+    int len;
+    if (t.type == FUNCTION) {
+        // aliases like adv and advantage get the same name
+        int f = t.left;
+        while (f > 0 && func_arr[f-1].func == func_arr[t.left].func) {
+            f--;
+        }
+        len = snprintf(buf+n, size-n, "%s", func_arr[f].name);
+    } else if (t.type == DICE_EXPRESSION) {
+        len = snprintf(buf+n, size-n, "%ldd%ld", t.left, t.right);
+    } else if (t.type == DROPPER) {
+        len = snprintf(buf+n, size-n, "%ldd%ldk%ld", t.left, t.right, t.len);
+    } else if (t.type == CONSTANT) {
+        len = snprintf(buf+n, size-n, "%ld", t.left);
+    } else {
+        len = snprintf(buf+n, size-n, "%c", t.type);
+    }
+    if (len < 0 || len >= size-n) {
+        return -1;
+    }
+    return n+len;
+}
+
+/**
+ * Works out the structural hash of every subexpression in the RPN queue, ie
+ * for each position i, the hash of the subexpression whose last token is
+ * queue[i] and the position where that subexpression starts. Arguments of
+ * commutative operators are put in a fixed order, so 3d6+2 and 2+3d6 hash
+ * the same. Also writes out the canonical text of each subexpression.
+ *
+ * \param q Length of the RPN queue
+ * \param[out] hashes hashes[i] is the hash of the subexpression ending at i
+ * \param[out] starts starts[i] is where the subexpression ending at i starts
+ * \param[out] texts texts[i] is the canonical text of the subexpression ending
+ * at i, or NULL if it's too long
+ * \return 0 on success, -1 if the queue doesn't make sense (in which case
+ * reverse_polish will complain about it)
+ */
+int hash_subexpressions(const int q, uint64_t* hashes, int* starts,
+                        const char** texts) {
+    const Token* queue = CTX->queue;
+    int s = 0;
+    int stack_i[128]; // positions in the queue of the values on the stack
+    int text_used = 0;
+    for (int i = 0; i < q; i++) {
+        const Token t = queue[i];
+        const char* args[128];
+        int num_args = 0;
+        uint64_t h = hash_mix(0, (uint64_t)(unsigned char)t.type);
+        int start = i;
+        if (is_operator(t)) {
+            if (s < 2) {
+                return -1;
+            }
+            uint64_t a = hashes[stack_i[s-2]];
+            uint64_t b = hashes[stack_i[s-1]];
+            args[0] = texts[stack_i[s-2]];
+            args[1] = texts[stack_i[s-1]];
+            num_args = 2;
+            if ((t.type == OP_ADD || t.type == OP_MUL || t.type == OP_EQU
+                 || t.type == OP_NEQ) && a > b) {
+                uint64_t temp = a;
+                a = b;
+                b = temp;
+                const char* temp_text = args[0];
+                args[0] = args[1];
+                args[1] = temp_text;
+            }
+            h = hash_mix(hash_mix(h, a), b);
+            start = starts[stack_i[s-2]];
+            s -= 2;
+        } else if (t.type == FUNCTION) {
+            num_args = func_arr[t.left].num_args;
+            if (s < num_args || num_args < 1) {
+                return -1;
+            }
+            h = hash_mix(h, (uint64_t)t.left);
+            for (int k = s-num_args; k < s; k++) {
+                h = hash_mix(h, hashes[stack_i[k]]);
+                args[k-(s-num_args)] = texts[stack_i[k]];
+            }
+            start = starts[stack_i[s-num_args]];
+            s -= num_args;
+        } else {
+            h = hash_mix(h, (uint64_t)t.left);
+            if (t.type == DICE_EXPRESSION) {
+                h = hash_mix(h, (uint64_t)t.right);
+            } else if (t.type == DROPPER) {
+                h = hash_mix(hash_mix(h, (uint64_t)t.right), (uint64_t)t.len);
+            }
+        }
+        hashes[i] = h;
+        starts[i] = start;
+        stack_i[s++] = i;
+        const int len = write_canonical_text(CTX->expr_text_buf + text_used,
+                                             EXPR_TEXT_BUF_LEN - text_used,
+                                             t, args, num_args);
+        if (len == -1) {
+            texts[i] = NULL;
+        } else {
+            texts[i] = CTX->expr_text_buf + text_used;
+            text_used += len+1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the key for the result cache file: the canonical text of the
+ * subexpression, plus the settings that change results.
+ *
+ * \return key, or NULL if text is NULL or it doesn't fit
+ */
+const char* result_cache_key(const char* text, char* key, const int size) {
+    if (text == NULL) {
+        return NULL;
+    }
+    const int len = snprintf(key, size, "exact=%d prune=%.17g: %s",
+                             exact_mode, prune_budget, text);
+    return (len < 0 || len >= size) ? NULL : key;
+}
+
+/**
+ * Looks for a subexpression's result in the memo, then in the result cache
+ * file. Results that had more pruned off them than what's left of
+ * prune_budget are skipped, since working it out again now would prune less.
+ *
+ * \return 1 if found (and stored in out), 0 otherwise
+ */
+int find_result(const uint64_t hash, const char* text, Token* out) {
+    const double max_pruned = prune_budget - CTX->pruned_mass;
+    if (expr_memo_find(hash, text, max_pruned, out)) {
+        return 1;
+    }
+    char key[1024];
+    double pruned;
+    const char* k = result_cache_key(text, key, sizeof(key));
+    if (k != NULL && result_cache_find(k, max_pruned, out, &pruned)) {
+        CTX->pruned_mass += pruned;
+        expr_memo_insert(hash, text, *out, pruned);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Saves a freshly computed result to the memo and the result cache file.
+ */
+void save_result(const uint64_t hash, const char* text, const Token t,
+                 const double pruned) {
+    expr_memo_insert(hash, text, t, pruned);
+    char key[1024];
+    const char* k = result_cache_key(text, key, sizeof(key));
+    if (k != NULL) {
+        result_cache_append(k, t, pruned);
+    }
 }
 
+/**
+ * Applies a binary operator.
+ *
+ * \param type An OP_XXX constant
+ * \param x Left operand (gets freed)
+ * \param y Right operand (gets freed)
+ * \return x (type) y
+ */
+Token apply_operator(const char type, Token x, Token y) {
+    // Sparse operands (see sparse.c) only go to the operators that know about
+    // them. Everything else gets dense arrays.
+    if (use_sparse_arith(type, x, y)) {
+        return sparse_arithTT(type, x, y);
+    } else if (type != OP_POW) {
+        x = T_unsparse(x);
+        y = T_unsparse(y);
+        if (x.type == INVALID || y.type == INVALID) {
+            return discard_operands(x, y);
+        }
+    }
+    switch (type) {
+    case OP_ADD: return addT(x, y);
+    case OP_MUL: return mulT(x, y);
+    case OP_DIV: return divT(x, y);
+    case OP_EQU: return equT(x, y);
+    case OP_NEQ: return neqT(x, y);
+    case OP_GRE: return greT(x, y);
+    case OP_GEQ: return geqT(x, y);
+    case OP_LES: return lesT(x, y);
+    case OP_LEQ: return leqT(x, y);
+    case OP_SUB: return subT(x, y);
+    case OP_AT:  return of_T(x, y);
+    case OP_MOD: return modT(x, y);
+    case OP_POW: return powT(x, y);
+    }
+    fprintf(ERR_STREAM, "type '%c' not implemented in reverse_polish\n", type);
+    return discard_operands(x, y);
+}
+
+#ifdef _OPENMP
+// Expressions like (40d20+30d12)*(20d100@1d8) have parts that don't depend on
+// each other, which can be worked out on different cores. For those, the RPN
+// queue is turned into a DAG with a node for each subexpression, and each
+// node is worked out (as an OpenMP task) as soon as its arguments are done.
+// Repeated subexpressions, like the 3d6+2 in (3d6+2)*(3d6+2), are only worked
+// out once and then copied.
+
+// Most arguments a node can have. More than any function in func_arr takes.
+#define DAG_MAX_ARGS 8
+// Independent parts are only worked out in parallel if they each involve a
+// PMF at least this long. Smaller ones aren't worth starting threads for.
+#define DAG_PARALLEL_MIN_LEN 1024
+
+typedef struct DagNode {
+    Token value; // the token from the RPN queue, then its result
+    int args[DAG_MAX_ARGS]; // nodes whose values are the arguments
+    int num_args;
+    int pending; // number of arguments that aren't done yet
+    int parent; // node that takes this one's value, -1 for the root
+    int queue_i; // position in the RPN queue of this subexpression's last token
+    int cached; // 1 if value came from find_result and is already done
+    int copy_of; // node this one copies the value of, or -1
+    int first_copy; // first node that copies this one, or -1
+    int next_copy; // next node that copies the same node as this one, or -1
+} DagNode;
+
+typedef struct Dag {
+    DagNode nodes[128];
+    int num_nodes;
+    int failed; // 1 once anything has gone wrong
+    DiceContext* owner; // context of the thread that's evaluating
+    const uint64_t* hashes;
+    const char** texts;
+} Dag;
+
+/**
+ * Decides whether the RPN queue has independent parts big enough to be worth
+ * working out in parallel, ie an operator or function with at least two
+ * arguments that each involve a PMF of DAG_PARALLEL_MIN_LEN entries or more.
+ * Only a rough guess, from the sizes of the dice.
+ *
+ * \param q Length of the RPN queue, which must make sense (see
+ * hash_subexpressions)
+ */
+int worth_parallel(const int q) {
+    const Token* queue = CTX->queue;
+    double size[128]; // rough length of the biggest PMF in each stack value
+    int s = 0;
+    for (int i = 0; i < q; i++) {
+        const Token t = queue[i];
+        if (is_operator(t) || t.type == FUNCTION) {
+            const int n = is_operator(t) ? 2 : func_arr[t.left].num_args;
+            const int spreads = t.type == OP_MUL || t.type == OP_AT || t.type == OP_POW;
+            int big = 0;
+            double out = spreads ? 1.0 : 0.0;
+            for (int k = s-n; k < s; k++) {
+                big += size[k] >= DAG_PARALLEL_MIN_LEN;
+                out = spreads ? out*size[k] : out+size[k];
+            }
+            if (big >= 2) {
+                return 1;
+            }
+            s -= n;
+            size[s++] = out;
+        } else if (t.type == DICE_EXPRESSION || t.type == DROPPER) {
+            size[s++] = (double)t.left*(t.right-1) + 1;
+        } else {
+            size[s++] = 1.0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \return The context the current thread should work in while working out
+ * part of dag. The thread that started the evaluation keeps its own, and the
+ * others get contexts of their own (so their own plan caches) in
+ * dag->owner->workers.
+ */
+DiceContext* dag_worker_context(const Dag* dag) {
+    const int t = omp_get_thread_num();
+    if (t == 0) {
+        return dag->owner;
+    }
+    if (dag->owner->workers[t] == NULL) {
+        dag->owner->workers[t] = calloc(1, sizeof(DiceContext));
+    }
+    dag->owner->workers[t]->out = dag->owner->out;
+    dag->owner->workers[t]->err = dag->owner->err;
+    return dag->owner->workers[t];
+}
+
+/**
+ * Saves the result of node i to the memo and the result cache file. Those
+ * belong to the owner's context, and only one thread at a time gets to them.
+ */
+void dag_save(const Dag* dag, const int i) {
+    const DagNode* node = &dag->nodes[i];
+    DiceContext* const here = CTX;
+    #pragma omp critical (dice_results)
+    {
+        CTX = dag->owner;
+        // nothing is pruned when evaluating in parallel
+        save_result(dag->hashes[node->queue_i], dag->texts[node->queue_i],
+                    node->value, 0.0);
+        CTX = here;
+    }
+}
+
+void dag_run(Dag* dag, const int i);
+
+/**
+ * Tells node p that one of its arguments is done. Once they all are, it's
+ * worked out, right here if run_here is 1, otherwise as a new task.
+ */
+void dag_notify(Dag* dag, const int p, const int run_here) {
+    int left;
+    #pragma omp atomic capture seq_cst
+    left = --dag->nodes[p].pending;
+    if (left != 0) {
+        return;
+    }
+    if (run_here) {
+        dag_run(dag, p);
+    } else {
+        #pragma omp task
+        dag_run(dag, p);
+    }
+}
+
+/**
+ * Hands the value of node i to everything waiting for it: first to copies
+ * of it, since whatever takes the value itself is allowed to free it, then
+ * to its parent.
+ */
+void dag_finish(Dag* dag, const int i) {
+    const DagNode* node = &dag->nodes[i];
+    for (int c = node->first_copy; c != -1; c = dag->nodes[c].next_copy) {
+        dag->nodes[c].value = copy_token(node->value);
+    }
+    for (int c = node->first_copy; c != -1; c = dag->nodes[c].next_copy) {
+        dag_notify(dag, dag->nodes[c].parent, 0);
+    }
+    if (node->parent != -1) {
+        dag_notify(dag, node->parent, 1);
+    }
+}
+
+/**
+ * Works out node i, whose arguments are all done, and passes its value on.
+ * If anything has gone wrong already, this just frees the arguments, so that
+ * everything still gets freed on the way up to the root.
+ */
+void dag_run(Dag* dag, const int i) {
+    DagNode* node = &dag->nodes[i];
+    DiceContext* const old = CTX;
+    CTX = dag_worker_context(dag);
+    if (node->cached) {
+        // nothing to do
+    } else if (node->num_args == 0) {
+        prepare_token(&node->value);
+        if (node->value.type == PMF) { // eg 10d10
+            dag_save(dag, i);
+        }
+    } else {
+        Token args[DAG_MAX_ARGS];
+        int failed;
+        #pragma omp atomic read
+        failed = dag->failed;
+        for (int k = 0; k < node->num_args; k++) {
+            args[k] = dag->nodes[node->args[k]].value;
+            failed |= args[k].type == INVALID;
+        }
+        if (failed) {
+            for (int k = 0; k < node->num_args; k++) {
+                free_token(args[k]);
+            }
+            node->value = invalid_token();
+        } else if (is_operator(node->value)) {
+            node->value = apply_operator(node->value.type, args[0], args[1]);
+        } else {
+            int64_t num_args = 0;
+            node->value = apply_func(node->value, &args[node->num_args-1], &num_args);
+        }
+        if (node->value.type == INVALID) {
+            #pragma omp atomic write
+            dag->failed = 1;
+        } else {
+            dag_save(dag, i);
+        }
+    }
+    CTX = old;
+    dag_finish(dag, i);
+}
+
+/**
+ * Like reverse_polish, but works out independent parts of the expression in
+ * parallel (see the top of this section). Never prunes.
+ *
+ * \param q Length of the RPN queue, which must make sense (see
+ * hash_subexpressions)
+ * \param hashes, starts, texts As given by hash_subexpressions
+ * \return The value of the expression, or invalid_token()
+ */
+Token reverse_polish_parallel(const int q, const uint64_t* hashes,
+                              const int* starts, const char** texts) {
+    const Token* queue = CTX->queue;
+    Dag* dag = malloc(sizeof(Dag));
+    dag->num_nodes = 0;
+    dag->failed = 0;
+    dag->owner = CTX;
+    dag->hashes = hashes;
+    dag->texts = texts;
+    int stack[128]; // nodes whose values are on the RPN stack
+    int s = 0;
+    for (int i = 0; i < q; i++) {
+        const int id = dag->num_nodes++;
+        DagNode* node = &dag->nodes[id];
+        node->num_args = 0;
+        node->pending = 0;
+        node->parent = -1;
+        node->queue_i = i;
+        node->cached = 0;
+        node->copy_of = -1;
+        node->first_copy = -1;
+        node->next_copy = -1;
+        // Like in reverse_polish, look for the biggest subexpression starting
+        // here that we already have, or that's already in the DAG.
+        for (int j = q-1; j >= i; j--) {
+            if (starts[j] != i || queue[j].type == CONSTANT) {
+                continue;
+            }
+            if (find_result(hashes[j], texts[j], &node->value)) {
+                node->cached = 1;
+            } else if (texts[j] != NULL) {
+                // Same as find_result: a matching hash isn't enough, the text
+                // has to match too.
+                for (int e = 0; e < id; e++) {
+                    const int other = dag->nodes[e].queue_i;
+                    if (dag->nodes[e].copy_of == -1 && hashes[other] == hashes[j]
+                            && texts[other] != NULL && !strcmp(texts[other], texts[j])) {
+                        node->copy_of = e;
+                        node->pending = 1;
+                        node->next_copy = dag->nodes[e].first_copy;
+                        dag->nodes[e].first_copy = id;
+                        break;
+                    }
+                }
+            }
+            if (node->cached || node->copy_of != -1) {
+                node->queue_i = j;
+                i = j;
+                break;
+            }
+        }
+        if (!node->cached && node->copy_of == -1) {
+            node->value = queue[i];
+            if (is_operator(queue[i]) || queue[i].type == FUNCTION) {
+                node->num_args = is_operator(queue[i]) ? 2
+                                 : func_arr[queue[i].left].num_args;
+                s -= node->num_args;
+                for (int k = 0; k < node->num_args; k++) {
+                    node->args[k] = stack[s+k];
+                    dag->nodes[stack[s+k]].parent = id;
+                }
+                node->pending = node->num_args;
+            }
+        }
+        stack[s++] = id;
+    }
+    if (s != 1) {
+        fprintf(ERR_STREAM, "Invalid input (type 4).\n");
+        for (int i = 0; i < dag->num_nodes; i++) {
+            if (dag->nodes[i].cached) {
+                free_token(dag->nodes[i].value);
+            }
+        }
+        free(dag);
+        return invalid_token();
+    }
+    // Make room for the other threads' contexts
+    const int threads = omp_get_max_threads();
+    if (CTX->num_workers < threads) {
+        CTX->workers = realloc(CTX->workers, threads*sizeof(DiceContext*));
+        for (int t = CTX->num_workers; t < threads; t++) {
+            CTX->workers[t] = NULL;
+        }
+        CTX->num_workers = threads;
+    }
+    // Everything that's ready now. This has to be found before starting any
+    // tasks, since they make more nodes ready as they go.
+    int ready[128];
+    int num_ready = 0;
+    for (int i = 0; i < dag->num_nodes; i++) {
+        if (dag->nodes[i].pending == 0) {
+            ready[num_ready++] = i;
+        }
+    }
+    #pragma omp parallel
+    #pragma omp single
+    for (int r = 0; r < num_ready; r++) {
+        const int i = ready[r];
+        #pragma omp task
+        dag_run(dag, i);
+    }
+    const Token out = dag->nodes[stack[0]].value;
+    free(dag);
+    return out;
+}
+#endif
+
 /**
  * Reads in tokens from the RPN queue and acts as an RPN calculator on them.
  * For example, if the queue is
  * [<5>, <2>, <+>, <2>, <*>],
  * then this returns <14>
  * 
+ * If anything goes wrong, everything on the stack is freed and this returns
+ * invalid_token(). Caches are left as they are, so a bad input doesn't cost
+ * anything that was already worked out.
+ *
  * \param q Length of the RPN queue
  * \return Returns the last output of the RPN calculations.
  */
 Token reverse_polish(const int q) {
+    Token* stack = CTX->stack;
+    Token* queue = CTX->queue;
     debug("reverse_polish stack:");
     for (int i = 0; i < q; i++) {
         debug_print_token(queue[i]);
     }
     debug("\n");
+    uint64_t hashes[128];
+    int starts[128];
+    const char* texts[128];
+    double pruned_before[128];
+    const int use_memo = hash_subexpressions(q, hashes, starts, texts) == 0;
+#ifdef _OPENMP
+    // Pruning takes from a budget shared by the whole expression, so what
+    // gets pruned depends on the order things are worked out in. Keep that
+    // order fixed by not going parallel.
+    if (use_memo && prune_budget <= 0.0 && omp_get_max_threads() > 1
+            && !omp_in_parallel() && worth_parallel(q)) {
+        return reverse_polish_parallel(q, hashes, starts, texts);
+    }
+#endif
     int s = 0;
     for (int i = 0; i < q; i++) {
+        pruned_before[i] = CTX->pruned_mass;
+        if (use_memo) {
+            // If we've seen the biggest subexpression starting here before,
+            // use that and skip to the end of it.
+            int hit = 0;
+            for (int j = q-1; j >= i && !hit; j--) {
+                if (starts[j] == i && queue[j].type != CONSTANT
+                        && find_result(hashes[j], texts[j], &stack[s])) {
+                    s++;
+                    i = j;
+                    hit = 1;
+                }
+            }
+            if (hit) {
+                continue;
+            }
+        }
         prepare_token(queue+i);
         Token next = queue[i];
         if (is_operator(next)) {
-            switch(next.type) {
-            case OP_ADD: next = addT(stack[s-2], stack[s-1]); break;
-            case OP_MUL: next = mulT(stack[s-2], stack[s-1]); break;
-            case OP_DIV: next = divT(stack[s-2], stack[s-1]); break;
-            case OP_EQU: next = equT(stack[s-2], stack[s-1]); break;
-            case OP_NEQ: next = neqT(stack[s-2], stack[s-1]); break;
-            case OP_GRE: next = greT(stack[s-2], stack[s-1]); break;
-            case OP_GEQ: next = geqT(stack[s-2], stack[s-1]); break;
-            case OP_LES: next = lesT(stack[s-2], stack[s-1]); break;
-            case OP_LEQ: next = leqT(stack[s-2], stack[s-1]); break;
-            case OP_SUB: next = subT(stack[s-2], stack[s-1]); break;
-            case OP_AT:  next = of_T(stack[s-2], stack[s-1]); break;
-            case OP_MOD: next = modT(stack[s-2], stack[s-1]); break;
-            default:
-                fprintf(stderr, "type '%c' not implemented in reverse_polish\n", next.type);
-                Exit(1);
-                return next;
+            if (s < 2) {
+                goto invalid_input;
+            }
+            next = apply_operator(next.type, stack[s-2], stack[s-1]);
+            s -= 2; // the operator took care of its operands
+            if (next.type == INVALID) {
+                goto error;
+            }
+            stack[s++] = T_prune(next);
+            if (use_memo) {
+                save_result(hashes[i], texts[i], stack[s-1],
+                            CTX->pruned_mass - pruned_before[starts[i]]);
             }
-            stack[s-2] = next;
-            s -= 1;
         } else if (next.type == FUNCTION) {
+            if (s < func_arr[next.left].num_args) {
+                goto invalid_input;
+            }
             int64_t num_args = 0;
             Token return_value = apply_func(next, &stack[s-1], &num_args);
-            stack[s-num_args] = return_value;
-            s = s - num_args + 1;
-            //fprintf(stderr, "functions are not implemented in reverse_polish\n");
-            //Exit(1);
-            //return next;
+            s -= num_args;
+            if (return_value.type == INVALID) {
+                goto error;
+            }
+            stack[s++] = T_prune(return_value);
+            if (use_memo) {
+                save_result(hashes[i], texts[i], stack[s-1],
+                            CTX->pruned_mass - pruned_before[starts[i]]);
+            }
         } else {
             stack[s++] = next;
+            if (use_memo && next.type == PMF) { // eg 10d10
+                save_result(hashes[i], texts[i], next, 0.0);
+            }
         }
     }
+    if (s != 1) {
+        goto invalid_input;
+    }
     return stack[0];
+    invalid_input:
+    fprintf(ERR_STREAM, "Invalid input (type 4).\n");
+    error:
+    for (int k = 0; k < s; k++) {
+        free_token(stack[k]);
+    }
+    return invalid_token();
 }
 
 /**
@@ -346,8 +1106,13 @@ Token reverse_polish(const int q) {
  * 
  * \param tokens Array of tokens in infix order representing an expression
  * \param len Length of tokens
- * \return Returns the value of the expression
+ * \return Returns the value of the expression, or invalid_token() if it
+ * can't be worked out
  */
 Token pemdas(Token tokens[], const int len) {
-    return reverse_polish(shunting_yard(tokens, len));
+    const int q = shunting_yard(tokens, len);
+    if (q == -1) {
+        return invalid_token();
+    }
+    return reverse_polish(q);
 }
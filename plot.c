@@ -1,191 +1,212 @@
 #include "defs.c"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
-// This file makes neat ASCII plots.
+// This file makes neat ASCII plots. The whole plot is put together in one
+// buffer sized to the terminal and printed with a single write.
 
-/**
- * This draws a horizontal line to standard out.
- * 
- * \param main_cols The number of character columns we have to work with, as
- * specified in main.c
- */
-void draw_horiz(const int main_cols) {
-    for (int i = 0; i < LEFT_OFFSET-1; i++) {
-        PLOT_BUF[i] = ' ';
-    }
-    PLOT_BUF[LEFT_OFFSET-1] = '+';
-    for (int i = LEFT_OFFSET; i < LEFT_OFFSET+main_cols; i++) {
-        PLOT_BUF[i] = '-';
-    }
-    PLOT_BUF[LEFT_OFFSET+main_cols] = '+';
-    PLOT_BUF[LEFT_OFFSET+main_cols+1] = '\0';
-    //PLOT_BUF[LEFT_OFFSET+main_cols+1] = '\0';
-    printf("%s\n", PLOT_BUF);
-    fflush(stdout);
-}
-
-/**
- * This prints one row of the plot window to standard out
- * 
- * \param left The label to put on the left of the row (negative for no label)
- * \param right The label to put on the right of the row (negative for no label)
- */
-void draw_main(const int main_cols, const int r, const double left, const double right) {
-    if (left < 0) {
-        for (int i = 0; i < LEFT_OFFSET-1; i++) {
-            PLOT_BUF[i] = ' ';
-        }
-        PLOT_BUF[LEFT_OFFSET-1] = '|';
-    } else {
-        sprintf(PLOT_BUF, "%1.6f|", left);
-    }
-    for (int i = LEFT_OFFSET; i < LEFT_OFFSET+main_cols; i++) {
-        if (DATA_BUF[i-LEFT_OFFSET] >= r) {
-            if (DATA_BUF[i-LEFT_OFFSET] >= r+(2.0/3)) {
-                PLOT_BUF[i] = '@';
-            } else if (DATA_BUF[i-LEFT_OFFSET] >= r+(1.0/3)) {
-                PLOT_BUF[i] = 'g';
-            } else if (DATA_BUF[i-LEFT_OFFSET] >= r+.1) {
-                PLOT_BUF[i] = '_';
-            } else {
-                PLOT_BUF[i] = ' ';
-            }
-        } else {
-            PLOT_BUF[i] = ' ';
-        }
-    }
-    PLOT_BUF[LEFT_OFFSET+main_cols] = '|';
-    if (right < 0) {
-        PLOT_BUF[LEFT_OFFSET+main_cols+1] = '\0';
-    } else {
-        sprintf(PLOT_BUF+LEFT_OFFSET+main_cols+1, "%1.9f", right);
-    }
-    printf("%s\n", PLOT_BUF);
-    fflush(stdout);
-}
+// Number of entries of the PMF fit_data looks at together. A block stays in
+// cache while we go over it twice to get its mean and variance.
+#define PLOT_BLOCK_LEN 4096
 
 /**
- * Parses a large array into something short that we can easily plot
- * 
+ * Works out the mean and standard deviation of the input PMF and fits it into
+ * main_cols columns, all in one pass over the data.
+ *
+ * If the data is longer than main_cols, each column gets the max of a "bin" of
+ * step data points (and the last bin is left out). If it's shorter, the data
+ * points are spread out with -step columns between them.
+ *
  * \param[in] data The input PMF as an array. Should be positive, sum to 1.
- * \param len Length of data
+ * \param data_len Length of data
+ * \param stride Distance between the abscissas of consecutive entries of data.
+ * The plot is spaced out as if there were zeros in between.
  * \param main_cols Number of character columns to fit the ASCII art into
  * \param main_rows Number of character rows to fit the ASCII art into
  * \param start Abscissa value of data[0]
+ * \param[out] heights Place to store the height of each column in rows. Must
+ * have main_cols+1 zeros in it.
  * \param[out] max Location to store the max of data
- * \param[out] step Location to store the step size, as used by last2()
+ * \param[out] step Location to store the step size, as used by draw_axis()
  * \param[out] mean Location to store the expected value of the input PMF
  * \param[out] stdev Location to put the standard deviation of the input PMF
+ * \return Number of columns actually used
  */
-int fit_data(const double* data, const int64_t len, const int main_cols,
-             const int main_rows, const int64_t start,
-             double* max, int* step, double* mean, double* stdev) {
-    int out = 0;
-    double mu, s, weight_sum, new_max;
-    mu = s = weight_sum = new_max = 0.0;
-    for (int64_t i = 0; i < len; i++) {
-        double weight = data[i];
-        if (weight > new_max) {
-            new_max = weight;
-        }
-        if (weight==0.0) {
-            continue;
-        }
-        int64_t x = i+start;
-        weight_sum += weight;
-        double old_mu = mu;
-        mu += (weight / weight_sum) * (x - old_mu);
-        s += weight * (x - old_mu) * (x - mu);
-    }
-    *max = new_max;
-    *mean = mu;
-    *stdev = sqrt(s/weight_sum);
-    for (int i = 0; i < PLOT_BUF_LEN; i++) {
-        DATA_BUF[i] = -1.0;
-    }
-    //int out_len = -1;
+int fit_data(const double* data, const int64_t data_len, const int64_t stride,
+             const int main_cols, const int main_rows, const int64_t start,
+             double* heights, double* max, int* step, double* mean,
+             double* stdev) {
+    // From here on len is the spaced out length, as if there were zeros
+    // between the entries of data.
+    const int64_t len = (data_len-1)*stride + 1;
+    int out;
+    int binned = 0;
+    int64_t spacing = 1; // columns per position, when not binned
     *step = 1;
     if (len > main_cols) {
+        binned = 1;
         *step = len/main_cols;
         if (len%main_cols > 0) {
             *step += 1;
         }
-        // set each value to the max it can see
-        int bin = 0;
-        int done = 0;
-        while (!done) {
-            double bin_max = -1.0;
-            for (int i = 0; i < *step; i++) {
-                if (bin*(*step)+i >= len) {
-                    if (bin_max == -1.0) {
-                        out = bin-1;
-                    } else {
-                        out = bin;
-                    }
-                    done = 1;
-                    break;
-                }
-                if (data[bin*(*step)+i] > bin_max) {
-                    bin_max = data[bin*(*step)+i];
-                }
-            }
-            if (bin_max <= 0.0) {
-                DATA_BUF[bin] = -1;
-            } else {
-                DATA_BUF[bin] = bin_max/(*max) * main_rows;
-            }
-            bin += 1;
-        }
-    } else if (len < main_cols) { // Seems to work properly
+        out = (len + *step - 1)/(*step) - 1;
+    } else if (len < main_cols) {
         *step = main_cols/len;
         if ((*step+1)*(len-1)+1 < main_cols) {
             *step += 1;
         }
-        int64_t i = 0;
-        while (i < len) {
-            DATA_BUF[i*(*step)] = data[i]/(*max)*main_rows;
-            i += 1;
-        }
+        spacing = *step;
         out = *step*(len-1)+1;
         *step *= -1;
-    } else { // Should work properly
-        for (int64_t i = 0; i < len; i++) {
-            DATA_BUF[i] = data[i]/(*max)*main_rows;
-        }
+    } else {
         out = len;
     }
+    // Each block's mean and variance are found directly, then combined with
+    // the running totals like in Chan et al's parallel variance algorithm.
+    double total_weight, total_mean, total_m2;
+    total_weight = total_mean = total_m2 = 0.0;
+    const double dstride = (double)stride;
+    for (int64_t begin = 0; begin < data_len; begin += PLOT_BLOCK_LEN) {
+        const int64_t end = (begin + PLOT_BLOCK_LEN < data_len) ?
+                            begin + PLOT_BLOCK_LEN : data_len;
+        double weight, moment;
+        weight = moment = 0.0;
+        double x = (double)(start + begin*stride);
+        int64_t i = begin;
+        while (i < end) {
+            // [i, next) all goes in one column
+            int64_t col, next;
+            if (binned) {
+                col = i*stride/(*step);
+                next = ((col+1)*(*step) + stride - 1)/stride;
+                if (next > end) {
+                    next = end;
+                }
+            } else {
+                col = i*stride*spacing;
+                next = i+1;
+            }
+            double col_max = heights[col];
+            for (int64_t j = i; j < next; j++) {
+                const double w = data[j];
+                weight += w;
+                moment += w*x;
+                x += dstride;
+                if (w > col_max) {
+                    col_max = w;
+                }
+            }
+            heights[col] = col_max;
+            i = next;
+        }
+        if (weight == 0.0) {
+            continue;
+        }
+        const double block_mean = moment/weight;
+        double m2 = 0.0;
+        x = (double)(start + begin*stride);
+        for (int64_t j = begin; j < end; j++) {
+            const double d = x - block_mean;
+            m2 += data[j]*d*d;
+            x += dstride;
+        }
+        const double new_weight = total_weight + weight;
+        const double delta = block_mean - total_mean;
+        total_mean += delta*(weight/new_weight);
+        total_m2 += m2 + delta*delta*(total_weight*weight/new_weight);
+        total_weight = new_weight;
+    }
+    // every entry went into some column, so the max is the tallest column
+    double new_max = 0.0;
+    for (int i = 0; i <= out; i++) {
+        if (heights[i] > new_max) {
+            new_max = heights[i];
+        }
+    }
+    *max = new_max;
+    *mean = total_mean;
+    *stdev = sqrt(total_m2/total_weight);
+    for (int i = 0; i < out; i++) {
+        heights[i] = heights[i]/(*max) * main_rows;
+    }
     return out;
 }
 
 /**
- * Prints the last two rows of the ASCII art to standard out.
+ * Writes a horizontal line into the frame.
  *
+ * \param[out] pos Where in the frame to write it
+ * \param main_cols The number of character columns in the plot area
+ * \return Position in the frame after the line
+ */
+char* draw_horiz(char* pos, const int main_cols) {
+    memset(pos, ' ', LEFT_OFFSET-1);
+    pos += LEFT_OFFSET-1;
+    *pos++ = '+';
+    memset(pos, '-', main_cols);
+    pos += main_cols;
+    *pos++ = '+';
+    *pos++ = '\n';
+    return pos;
+}
+
+/**
+ * Fills in the plot area one column at a time, from the bottom up to the top
+ * of each column.
+ *
+ * \param[out] cells main_rows rows of main_cols characters, top row first,
+ * filled with spaces
+ * \param[in] heights Height of each column in rows, as given by fit_data()
+ */
+void draw_columns(char* cells, const double* heights, const int main_cols,
+                  const int main_rows) {
+    for (int c = 0; c < main_cols; c++) {
+        const double h = heights[c];
+        int r = 0;
+        while (r < main_rows && h >= r+(2.0/3)) {
+            cells[(main_rows-1-r)*main_cols + c] = '@';
+            r++;
+        }
+        if (r < main_rows && h >= r) {
+            char* cell = &cells[(main_rows-1-r)*main_cols + c];
+            if (h >= r+(1.0/3)) {
+                *cell = 'g';
+            } else if (h >= r+.1) {
+                *cell = '_';
+            }
+        }
+    }
+}
+
+/**
+ * Writes the last two rows of the ASCII art into the frame: the x-axis with
+ * tick marks, and the tick labels.
+ *
+ * \param[out] pos Where in the frame to write them
  * \param start leftmost x-label
  * \param step If positive, the number of data points per "bin" (char column) in the plot.
  * If negative, the number of columns per data point.
  * \param main_cols Number of character columns to fit each row into.
+ * \return Position in the frame after the rows
  */
-void last2(const int64_t start, const int step, const int main_cols) {
-    char PLOT_BUF2[PLOT_BUF_LEN];
-    for (int i = 0; i < PLOT_BUF_LEN; i++) {
-        PLOT_BUF2[i] = ' ';
-    }
-    for (int i = 0; i < LEFT_OFFSET-1; i++) {
-        PLOT_BUF[i] = ' ';
-        PLOT_BUF2[i] = ' ';
-    }
-    PLOT_BUF[LEFT_OFFSET-1] = '+';
-    for (int i = LEFT_OFFSET; i < LEFT_OFFSET+main_cols; i++) {
-        PLOT_BUF[i] = '-';
-    }
-    PLOT_BUF[LEFT_OFFSET+main_cols] = '+';
-    PLOT_BUF[LEFT_OFFSET+main_cols+1] = '\0';
+char* draw_axis(char* pos, const int64_t start, const int step,
+                const int main_cols) {
+    // The labels can go past the end of the axis by up to one step and label
+    const size_t labels_len = LEFT_OFFSET + 2*main_cols + (step < 0 ? -step : 0) + 64;
+    char* labels = malloc(labels_len);
+    memset(labels, ' ', labels_len);
+    char* axis = pos;
+    draw_horiz(axis, main_cols);
     int cumulative = 0;
     while (cumulative < main_cols) {
         if (step < 0 && cumulative > 0) {
             cumulative = ((cumulative/(-step)) + 1) * (-step);
         }
-        PLOT_BUF[LEFT_OFFSET+cumulative] = '+';
+        if (cumulative <= main_cols) {
+            axis[LEFT_OFFSET+cumulative] = '+';
+        }
         int val = 0;
         if (step == 1) {
             val = cumulative+start;
@@ -194,52 +215,74 @@ void last2(const int64_t start, const int step, const int main_cols) {
         } else {
             val = -cumulative/step + start;
         }
-        cumulative += sprintf(PLOT_BUF2+cumulative+LEFT_OFFSET, "%d    ", val);
-        PLOT_BUF2[LEFT_OFFSET+cumulative] = ' ';
-        if (step < 0) {
-            //cumulative = ((cumulative/(-step)) + 1) * (-step);
-        }
+        cumulative += sprintf(labels+cumulative+LEFT_OFFSET, "%d    ", val);
+        labels[LEFT_OFFSET+cumulative] = ' ';
     }
-    PLOT_BUF2[LEFT_OFFSET+cumulative] = '\0';
-    printf("%s\n", PLOT_BUF);
-    printf("%s\n", PLOT_BUF2);
-    fflush(stdout);
+    pos += LEFT_OFFSET + main_cols + 2;
+    memcpy(pos, labels, LEFT_OFFSET+cumulative);
+    pos += LEFT_OFFSET+cumulative;
+    *pos++ = '\n';
+    free(labels);
+    return pos;
 }
 
 /** Draws an ASCII plot of the input data to standard out.
- * 
+ *
  * \param rows Number of rows (height) the plot must fit into
  * \param cols Number of columns (width) the plot must fit into
  * \param[in] data Array to plot. Should be positive, sum to 1.
  * \param start Abscissa of data[0]
  * \param len Length of data
+ * \param stride Distance between the abscissas of consecutive entries of data
+ * \param[in] stats NULL, or the mean and standard deviation to print instead
+ * of the ones worked out from data, when data is only an approximation
  */
-void draw(const int rows, int cols, const double* data,
-          const int64_t start, const int64_t len) {
-    for (int i = 0; i < PLOT_BUF_LEN; i++) {
-        PLOT_BUF[i] = '\0';
-    }
-    if (cols > PLOT_BUF_LEN) {
-        cols = PLOT_BUF_LEN;
-    }
-    // we fit the data into DATA_BUF
+void draw(const int rows, const int cols, const double* data,
+          const int64_t start, const int64_t len, const int64_t stride,
+          const double* stats) {
     int main_cols = cols-LEFT_OFFSET-RIGHT_OFFSET;
-    int main_rows = rows-6;
-    //draw_horiz(main_cols);
+    if (main_cols < 1) {
+        main_cols = 1;
+    }
+    const int main_rows = (rows > 6) ? rows-6 : 0;
+    double* heights = calloc(main_cols+1, sizeof(double));
     double max;
     int step;
     double mean, stdev;
-    main_cols = fit_data(data, len, main_cols, main_rows, start,
-                         &max, &step, &mean, &stdev);
-    printf("Average: %.15g, Standard deviation: %.15g\n", mean, stdev);
-    draw_horiz(main_cols);
+    main_cols = fit_data(data, len, stride, main_cols, main_rows, start,
+                         heights, &max, &step, &mean, &stdev);
+    if (stats != NULL) {
+        mean = stats[0];
+        stdev = stats[1];
+    }
+    char* cells = malloc((size_t)main_rows*main_cols + 1);
+    memset(cells, ' ', (size_t)main_rows*main_cols);
+    draw_columns(cells, heights, main_cols, main_rows);
+    // a line of cells plus the borders, a label and the newline
+    const size_t row_len = LEFT_OFFSET + main_cols + 2 + 32;
+    const size_t size = 128 + (main_rows+2)*row_len + LEFT_OFFSET + 2*main_cols
+                        + (step < 0 ? -step : 0) + 64;
+    char* frame = malloc(size);
+    char* pos = frame;
+    pos += sprintf(pos, "Average: %.15g, Standard deviation: %.15g\n", mean, stdev);
+    pos = draw_horiz(pos, main_cols);
     int counter = 0;
     for (int r = main_rows-1; r >= 0; r--) {
-        double right = -1.0;
+        memset(pos, ' ', LEFT_OFFSET-1);
+        pos += LEFT_OFFSET-1;
+        *pos++ = '|';
+        memcpy(pos, cells + (size_t)(main_rows-1-r)*main_cols, main_cols);
+        pos += main_cols;
+        *pos++ = '|';
         if ((counter++)%5==0 || r==0) {
-            right = max*((double)r)/(main_rows-1);
+            pos += sprintf(pos, "%1.9f", max*((double)r)/(main_rows-1));
         }
-        draw_main(main_cols, r, -1.0, right);
+        *pos++ = '\n';
     }
-    last2(start, step, main_cols);
+    pos = draw_axis(pos, start, step, main_cols);
+    fwrite(frame, 1, pos-frame, OUT_STREAM);
+    fflush(OUT_STREAM);
+    free(frame);
+    free(cells);
+    free(heights);
 }
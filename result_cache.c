@@ -0,0 +1,415 @@
+#ifndef RESULT_CACHE_C
+#define RESULT_CACHE_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "defs.c"
+
+// This file implements a cache of results shared between processes, so that
+// running lots of short-lived copies of the program (like linux.sh does, one
+// per line) doesn't keep working out the same distributions. It's a file,
+// named by the environment variable DICE_RESULT_CACHE, that holds final and
+// intermediate results keyed by their canonical text (see
+// hash_subexpressions in pemdas.c). Each process mmaps the file and appends
+// whatever new results it works out. When the file has grown (because of our
+// appends or someone else's), the mapping is redone and the new records are
+// added to the index.
+//
+// Layout, in native byte order:
+//   header: the 8 bytes "DICERES\0", uint32 version, uint32 sizeof(double)
+//   records until the end of the file: a ResultRecord, then the key (not
+//   null-terminated) padded with zeros to a multiple of 8 bytes, then len
+//   doubles if the result is a PMF
+// Appends hold an exclusive flock and go out in a single write, and readers
+// index the file while holding a shared flock, so nobody ever sees half a
+// record. Within a process, everything that touches the mapping, the index or
+// the counters is in the OpenMP critical section result_cache, since contexts
+// on different threads share them. Not available on Windows.
+
+#define RESULT_CACHE_VERSION 1
+// Results bigger than this aren't written to the file
+#define RESULT_CACHE_MAX_BYTES (64LL*1024*1024)
+
+const char result_cache_magic[8] = {'D', 'I', 'C', 'E', 'R', 'E', 'S', '\0'};
+
+typedef struct ResultRecord {
+    uint64_t key_len; // in bytes, before padding
+    int64_t type; // PMF or CONSTANT
+    int64_t left;
+    int64_t len; // 0 for constants
+    int64_t stride;
+    double pruned; // probability pruned while working it out
+} ResultRecord;
+
+// For the ":stats" command, see result_cache_stats
+typedef struct ResultCacheStats {
+    int open; // whether DICE_RESULT_CACHE is in use
+    size_t entries;
+    uint64_t hits;
+    uint64_t writes;
+} ResultCacheStats;
+
+typedef struct ResultIndexEntry {
+    uint64_t hash; // of the key
+    size_t offset; // of the record in the file
+} ResultIndexEntry;
+
+int result_cache_fd = -1;
+const char* result_cache_data = NULL; // mapping of the file
+size_t result_cache_size = 0; // of the mapping
+size_t result_cache_indexed = 0; // where the first unindexed record starts
+ResultIndexEntry* result_cache_index = NULL; // sorted by hash
+size_t result_cache_index_len = 0;
+size_t result_cache_index_cap = 0;
+uint64_t result_cache_hits = 0;
+uint64_t result_cache_writes = 0;
+
+/**
+ * FNV-1a hash of a string.
+ */
+uint64_t hash_string(const char* str, const size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int result_index_cmp(const void* a, const void* b) {
+    const uint64_t x = ((const ResultIndexEntry*)a)->hash;
+    const uint64_t y = ((const ResultIndexEntry*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+size_t pad8(const size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+#ifndef _WIN32
+/**
+ * Checks the header of the mapped file.
+ *
+ * \return 0 if it's right, -1 otherwise
+ */
+int check_result_cache_header() {
+    const size_t header_size = sizeof(result_cache_magic) + 2*sizeof(uint32_t);
+    uint32_t header[2];
+    if (result_cache_size < header_size
+            || memcmp(result_cache_data, result_cache_magic, sizeof(result_cache_magic))) {
+        return -1;
+    }
+    memcpy(header, result_cache_data + sizeof(result_cache_magic), sizeof(header));
+    if (header[0] != RESULT_CACHE_VERSION || header[1] != sizeof(double)) {
+        return -1;
+    }
+    result_cache_indexed = header_size;
+    return 0;
+}
+
+/**
+ * Adds every complete record of the mapped file that isn't indexed yet to the
+ * index, keeping it sorted.
+ */
+void index_result_cache() {
+    const size_t old_len = result_cache_index_len;
+    size_t pos = result_cache_indexed;
+    while (pos + sizeof(ResultRecord) <= result_cache_size) {
+        ResultRecord record;
+        memcpy(&record, result_cache_data + pos, sizeof(record));
+        const size_t rest = result_cache_size - pos - sizeof(record);
+        if (record.key_len > rest || (record.type != PMF && record.type != CONSTANT)
+                || record.len < 0 || (uint64_t)record.len > rest/sizeof(double)
+                || pad8(record.key_len) + record.len*sizeof(double) > rest) {
+            break; // garbage or truncated, ignore the rest
+        }
+        if (result_cache_index_len == result_cache_index_cap) {
+            result_cache_index_cap = 2*result_cache_index_cap + 64;
+            result_cache_index = realloc(result_cache_index,
+                                         result_cache_index_cap*sizeof(ResultIndexEntry));
+        }
+        const char* key = result_cache_data + pos + sizeof(record);
+        result_cache_index[result_cache_index_len].hash = hash_string(key, record.key_len);
+        result_cache_index[result_cache_index_len].offset = pos;
+        result_cache_index_len++;
+        pos += sizeof(record) + pad8(record.key_len) + record.len*sizeof(double);
+    }
+    result_cache_indexed = pos;
+    if (result_cache_index_len == old_len) {
+        return;
+    }
+    // Sort the new entries, then merge them with the old ones from the back
+    ResultIndexEntry* fresh = result_cache_index + old_len;
+    const size_t fresh_len = result_cache_index_len - old_len;
+    qsort(fresh, fresh_len, sizeof(ResultIndexEntry), result_index_cmp);
+    ResultIndexEntry* copy = malloc(fresh_len*sizeof(ResultIndexEntry));
+    memcpy(copy, fresh, fresh_len*sizeof(ResultIndexEntry));
+    size_t i = old_len;
+    size_t j = fresh_len;
+    size_t k = result_cache_index_len;
+    while (j > 0) {
+        if (i > 0 && result_cache_index[i-1].hash > copy[j-1].hash) {
+            result_cache_index[--k] = result_cache_index[--i];
+        } else {
+            result_cache_index[--k] = copy[--j];
+        }
+    }
+    free(copy);
+}
+
+/**
+ * Maps the file again if it's grown since we last mapped it, and indexes the
+ * new records. Call this in the critical section result_cache.
+ *
+ * \param locked 1 if we already hold a flock on the file, 0 to take a shared
+ * one while reading
+ * \return 0 on success, -1 if the file couldn't be mapped
+ */
+int refresh_result_cache(const int locked) {
+    struct stat st;
+    if (fstat(result_cache_fd, &st) == -1 || (size_t)st.st_size <= result_cache_size) {
+        return 0;
+    }
+    if (!locked) {
+        flock(result_cache_fd, LOCK_SH);
+        fstat(result_cache_fd, &st);
+    }
+    if (result_cache_data != NULL) {
+        munmap((void*)result_cache_data, result_cache_size);
+    }
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, result_cache_fd, 0);
+    if (mem == MAP_FAILED) {
+        result_cache_data = NULL;
+        result_cache_size = 0;
+    } else {
+        result_cache_data = mem;
+        result_cache_size = st.st_size;
+        if (result_cache_indexed > 0) { // the header's been checked
+            index_result_cache();
+        }
+    }
+    if (!locked) {
+        flock(result_cache_fd, LOCK_UN);
+    }
+    return (result_cache_data == NULL) ? -1 : 0;
+}
+#endif
+
+/**
+ * Opens (or creates) the file named by the environment variable
+ * DICE_RESULT_CACHE, if it's set. Prints a warning and leaves the cache off if
+ * the file isn't usable.
+ */
+void init_result_cache() {
+    const char* path = getenv("DICE_RESULT_CACHE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+#ifdef _WIN32
+    fprintf(stderr, "DICE_RESULT_CACHE isn't supported on Windows, ignoring it\n");
+#else
+    result_cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (result_cache_fd == -1) {
+        fprintf(stderr, "Can't open result cache \"%s\", ignoring it\n", path);
+        return;
+    }
+    flock(result_cache_fd, LOCK_EX);
+    struct stat st;
+    if (fstat(result_cache_fd, &st) == 0 && st.st_size == 0) {
+        char header[sizeof(result_cache_magic) + 2*sizeof(uint32_t)];
+        const uint32_t versions[2] = {RESULT_CACHE_VERSION, sizeof(double)};
+        memcpy(header, result_cache_magic, sizeof(result_cache_magic));
+        memcpy(header + sizeof(result_cache_magic), versions, sizeof(versions));
+        if (write(result_cache_fd, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            st.st_size = -1;
+        }
+    }
+    // Downgrade so other processes can read while we index
+    flock(result_cache_fd, LOCK_SH);
+    int ok = refresh_result_cache(1) == 0 && check_result_cache_header() == 0;
+    if (ok) {
+        index_result_cache();
+    }
+    flock(result_cache_fd, LOCK_UN);
+    if (!ok) {
+        fprintf(stderr, "\"%s\" isn't a result cache from this version, "
+                "ignoring it\n", path);
+        if (result_cache_data != NULL) {
+            munmap((void*)result_cache_data, result_cache_size);
+            result_cache_data = NULL;
+        }
+        free(result_cache_index);
+        result_cache_index = NULL;
+        result_cache_index_len = 0;
+        result_cache_index_cap = 0;
+        close(result_cache_fd);
+        result_cache_fd = -1;
+    }
+#endif
+}
+
+#ifndef _WIN32
+/**
+ * Finds the record for key in the index. Call this in the critical section
+ * result_cache.
+ *
+ * \return Where the record starts in the mapping, or NULL if it isn't there
+ */
+const char* result_cache_lookup(const char* key) {
+    if (result_cache_data == NULL) {
+        return NULL;
+    }
+    const size_t key_len = strlen(key);
+    const uint64_t hash = hash_string(key, key_len);
+    // first entry with this hash
+    size_t lo = 0;
+    size_t hi = result_cache_index_len;
+    while (lo < hi) {
+        const size_t mid = lo + (hi-lo)/2;
+        if (result_cache_index[mid].hash < hash) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < result_cache_index_len && result_cache_index[lo].hash == hash; lo++) {
+        const char* pos = result_cache_data + result_cache_index[lo].offset;
+        ResultRecord record;
+        memcpy(&record, pos, sizeof(record));
+        if (record.key_len == key_len && memcmp(pos + sizeof(record), key, key_len) == 0) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Looks up a result in the file.
+ *
+ * \param key Canonical text of the expression
+ * \param max_pruned Results with more than this much probability pruned while
+ * working them out don't count
+ * \param[out] out Place to store a copy of the result, if we have it
+ * \param[out] pruned Place to store the probability pruned while working it out
+ * \return 1 if we had it, 0 otherwise
+ */
+int result_cache_find(const char* key, const double max_pruned, Token* out,
+                      double* pruned) {
+    if (result_cache_fd == -1) {
+        return 0;
+    }
+    int found = 0;
+#ifndef _WIN32
+    #pragma omp critical (result_cache)
+    {
+        refresh_result_cache(0);
+        const char* pos = result_cache_lookup(key);
+        ResultRecord record;
+        if (pos != NULL) {
+            memcpy(&record, pos, sizeof(record));
+            found = record.pruned <= max_pruned;
+        }
+        if (found) {
+            pos += sizeof(record) + pad8(record.key_len);
+            out->type = record.type;
+            out->left = record.left;
+            out->len = record.len;
+            out->stride = record.stride;
+            if (record.type == PMF) {
+                out->arr = malloc(record.len*sizeof(double));
+                memcpy(out->arr, pos, record.len*sizeof(double));
+            }
+            *pruned = record.pruned;
+            result_cache_hits++;
+        }
+    }
+#else
+    (void)key;
+    (void)max_pruned;
+    (void)out;
+    (void)pruned;
+#endif
+    return found;
+}
+
+/**
+ * Appends a result to the file, unless it's already there (maybe because
+ * another process put it there).
+ *
+ * \param key Canonical text of the expression
+ * \param t The result, of type PMF or CONSTANT
+ * \param pruned Probability pruned while working out t
+ */
+void result_cache_append(const char* key, const Token t, const double pruned) {
+#ifdef _WIN32
+    (void)key;
+    (void)t;
+    (void)pruned;
+#else
+    if (result_cache_fd == -1 || (t.type != PMF && t.type != CONSTANT)) {
+        return;
+    }
+    ResultRecord record;
+    record.key_len = strlen(key);
+    record.type = t.type;
+    record.left = t.left;
+    record.len = (t.type == PMF) ? t.len : 0;
+    record.stride = (t.type == PMF) ? t.stride : 1;
+    record.pruned = pruned;
+    const size_t arr_bytes = record.len*sizeof(double);
+    if (arr_bytes > RESULT_CACHE_MAX_BYTES) {
+        return;
+    }
+    const size_t size = sizeof(record) + pad8(record.key_len) + arr_bytes;
+    char* buf = calloc(size, 1);
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), key, record.key_len);
+    if (arr_bytes > 0) {
+        memcpy(buf + sizeof(record) + pad8(record.key_len), t.arr, arr_bytes);
+    }
+    #pragma omp critical (result_cache)
+    {
+        flock(result_cache_fd, LOCK_EX);
+        // Catch up on everything written so far, so we don't write a
+        // duplicate. Our own record gets indexed by the next refresh.
+        refresh_result_cache(1);
+        if (result_cache_lookup(key) == NULL
+                && write(result_cache_fd, buf, size) == (ssize_t)size) {
+            result_cache_writes++;
+        }
+        flock(result_cache_fd, LOCK_UN);
+    }
+    free(buf);
+#endif
+}
+
+/**
+ * Reads the counters, inside the critical section that guards them. entries
+ * counts everything in the file so far, including our own latest appends.
+ */
+void result_cache_stats(ResultCacheStats* out) {
+    #pragma omp critical (result_cache)
+    {
+#ifndef _WIN32
+        if (result_cache_fd != -1) {
+            refresh_result_cache(0);
+        }
+#endif
+        out->open = result_cache_fd != -1;
+        out->entries = result_cache_index_len;
+        out->hits = result_cache_hits;
+        out->writes = result_cache_writes;
+    }
+}
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef SPARSE_C
+#define SPARSE_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "defs.c"
+
+// This file implements sparse PMFs, stored as a sorted list of
+// (value, probability) pairs. Most distributions are dense, but things like
+// 1d6^3 only take 6 values between 1 and 216, and 1d6^1d6 takes 36 values
+// between 1 and 46656, so it's much cheaper to work them out this way. Results
+// like that stay sparse (tokens of type SPARSE) through +, -, * and the
+// comparisons, and are only made dense when something else needs them to be.
+
+// Biggest dense array we're willing to make out of a sparse PMF. 2^24 doubles
+// is 128 MB.
+#define SPARSE_MAX_DENSE_LEN (1LL << 24)
+// Results are kept sparse when a dense array would be more than this many
+// times longer
+#define SPARSE_MIN_SPREAD 4
+// Most pairs of values sparse_combine goes through. Past that, it's cheaper to
+// make the operands dense and use the FFT.
+#define SPARSE_MAX_PAIRS (1LL << 24)
+
+typedef struct SparseEntry {
+    int64_t value;
+    double prob;
+} SparseEntry;
+
+/**
+ * Sparse PMF. entries is sorted by value, with no repeated values and no
+ * zero probabilities.
+ */
+typedef struct SparsePMF {
+    SparseEntry* entries;
+    int64_t len;
+} SparsePMF;
+
+int sparse_entry_cmp(const void* a, const void* b) {
+    const int64_t x = ((const SparseEntry*)a)->value;
+    const int64_t y = ((const SparseEntry*)b)->value;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sorts the entries of x by value and adds together entries with the same
+ * value, dropping zeros. Use this after filling in entries in any order.
+ *
+ * \param[in,out] x Sparse PMF whose entries might be unsorted or repeated
+ */
+void sparse_normalize(SparsePMF* x) {
+    qsort(x->entries, x->len, sizeof(SparseEntry), sparse_entry_cmp);
+    int64_t j = -1;
+    for (int64_t i = 0; i < x->len; i++) {
+        if (x->entries[i].prob == 0.0) {
+            continue;
+        }
+        if (j >= 0 && x->entries[j].value == x->entries[i].value) {
+            x->entries[j].prob += x->entries[i].prob;
+        } else {
+            x->entries[++j] = x->entries[i];
+        }
+    }
+    x->len = j+1;
+}
+
+/**
+ * Converts a dense PMF to a sparse one. Doesn't free arr.
+ *
+ * \param[in] arr Dense PMF, arr[k] is the probability of left + k*stride
+ * \param len Length of arr
+ * \param left Value corresponding to arr[0]
+ * \param stride Distance between values of consecutive entries of arr
+ */
+SparsePMF dense_to_sparse(const double* arr, const int64_t len,
+                          const int64_t left, const int64_t stride) {
+    SparsePMF out;
+    out.entries = malloc((len > 0 ? len : 1)*sizeof(SparseEntry));
+    out.len = 0;
+    for (int64_t i = 0; i < len; i++) {
+        if (arr[i] != 0.0) {
+            out.entries[out.len].value = left + i*stride;
+            out.entries[out.len].prob = arr[i];
+            out.len++;
+        }
+    }
+    return out;
+}
+
+/**
+ * Works out how long a dense array holding x would be, using the biggest
+ * stride that fits all of its values.
+ *
+ * \param[in] x Normalized sparse PMF with at least one entry
+ * \param[out] strideptr Place to store the stride
+ * \return The length, or -1 if it would be longer than SPARSE_MAX_DENSE_LEN
+ */
+int64_t sparse_dense_len(const SparsePMF x, int64_t* strideptr) {
+    // Differences can overflow when the values are huge and of both signs,
+    // but they can't as unsigned numbers
+    uint64_t g = 0;
+    for (int64_t i = 1; i < x.len; i++) {
+        uint64_t d = (uint64_t)x.entries[i].value - (uint64_t)x.entries[i-1].value;
+        while (d != 0) {
+            const uint64_t t = g % d;
+            g = d;
+            d = t;
+        }
+    }
+    if (g == 0) {
+        g = 1;
+    }
+    const uint64_t span = (uint64_t)x.entries[x.len-1].value - (uint64_t)x.entries[0].value;
+    if (g > INT64_MAX || span/g >= SPARSE_MAX_DENSE_LEN) {
+        return -1;
+    }
+    *strideptr = g;
+    return span/g + 1;
+}
+
+/**
+ * Converts a sparse PMF to a dense one. Frees x. Fails if the dense array
+ * would be longer than SPARSE_MAX_DENSE_LEN.
+ *
+ * \param[in] x Normalized sparse PMF with at least one entry
+ * \param[out] leftptr Place to store the value corresponding to out[0]
+ * \param[out] lenptr Place to store the length of out
+ * \param[out] strideptr Place to store the distance between the values of
+ * consecutive entries of out
+ * \return Dense PMF, or NULL if it failed
+ */
+double* sparse_to_dense(SparsePMF x, int64_t* leftptr, int64_t* lenptr,
+                        int64_t* strideptr) {
+    const int64_t left = x.entries[0].value;
+    int64_t stride;
+    const int64_t len = sparse_dense_len(x, &stride);
+    if (len == -1) {
+        fprintf(ERR_STREAM, "Result is too spread out (from %ld to %ld).\n",
+                left, x.entries[x.len-1].value);
+        free(x.entries);
+        return NULL;
+    }
+    double* out = calloc(len, sizeof(double));
+    for (int64_t i = 0; i < x.len; i++) {
+        out[((uint64_t)x.entries[i].value - (uint64_t)left)/stride] += x.entries[i].prob;
+    }
+    free(x.entries);
+    *leftptr = left;
+    *lenptr = len;
+    *strideptr = stride;
+    return out;
+}
+
+/**
+ * Like sparse_to_dense, but if the dense array would be longer than max_len,
+ * adds up neighbouring values into at most max_len buckets instead of failing.
+ * Each bucket's value is the lowest value that can go in it. Frees x.
+ *
+ * \param[in] x Normalized sparse PMF with at least one entry
+ * \param max_len Most entries the result can have, at least 2
+ * \return Dense PMF, see sparse_to_dense
+ */
+double* sparse_to_buckets(SparsePMF x, const int64_t max_len, int64_t* leftptr,
+                          int64_t* lenptr, int64_t* strideptr) {
+    int64_t stride;
+    const int64_t len = sparse_dense_len(x, &stride);
+    if (len != -1 && len <= max_len) {
+        return sparse_to_dense(x, leftptr, lenptr, strideptr);
+    }
+    const uint64_t left = x.entries[0].value;
+    const uint64_t span = (uint64_t)x.entries[x.len-1].value - left;
+    const uint64_t width = span/(max_len-1) + 1;
+    *leftptr = left;
+    *lenptr = span/width + 1;
+    *strideptr = width;
+    double* out = calloc(*lenptr, sizeof(double));
+    for (int64_t i = 0; i < x.len; i++) {
+        out[((uint64_t)x.entries[i].value - left)/width] += x.entries[i].prob;
+    }
+    free(x.entries);
+    return out;
+}
+
+/**
+ * Integer exponentiation, in the same integer arithmetic as everything else,
+ * so negative exponents truncate toward zero like division does. Fails on
+ * overflow and on 0 to a negative power.
+ *
+ * \param[out] error Set to 1 if it failed, otherwise left alone
+ * \return base^e
+ */
+int64_t int_pow(int64_t base, int64_t e, int* error) {
+    if (e < 0) {
+        if (base == 0) {
+            fprintf(ERR_STREAM, "Cannot raise 0 to a negative power\n");
+            *error = 1;
+            return 0;
+        }
+        if (base == 1) {
+            return 1;
+        }
+        if (base == -1) {
+            return (e % 2 == 0) ? 1 : -1;
+        }
+        return 0;
+    }
+    int64_t out = 1;
+    while (e) {
+        if (e & 1) {
+            if (__builtin_mul_overflow(out, base, &out)) {
+                goto overflow;
+            }
+        }
+        e >>= 1;
+        if (e && __builtin_mul_overflow(base, base, &base)) {
+            goto overflow;
+        }
+    }
+    return out;
+    overflow:
+    fprintf(ERR_STREAM, "Number too big.\n");
+    *error = 1;
+    return 0;
+}
+
+/**
+ * Distribution of x (op) y, where x and y are independent, for the operators
+ * that are easy to work out one pair of values at a time: +, -, * and the
+ * comparisons. Doesn't free its inputs.
+ *
+ * \param[in] x Left operand
+ * \param[in] y Right operand
+ * \param op OP_ADD, OP_SUB, OP_MUL, OP_GRE, OP_LES, OP_GEQ, OP_LEQ, OP_EQU or
+ * OP_NEQ
+ * \return Normalized sparse PMF of x (op) y, or one with NULL entries if some
+ * value overflows
+ */
+SparsePMF sparse_combine(const SparsePMF x, const SparsePMF y, const char op) {
+    SparsePMF out;
+    out.len = x.len*y.len;
+    out.entries = malloc((out.len > 0 ? out.len : 1)*sizeof(SparseEntry));
+    int64_t k = 0;
+    for (int64_t i = 0; i < x.len; i++) {
+        const int64_t a = x.entries[i].value;
+        for (int64_t j = 0; j < y.len; j++) {
+            const int64_t b = y.entries[j].value;
+            int64_t v = 0;
+            int overflow = 0;
+            switch (op) {
+            case OP_ADD: overflow = __builtin_add_overflow(a, b, &v); break;
+            case OP_SUB: overflow = __builtin_sub_overflow(a, b, &v); break;
+            case OP_MUL: overflow = __builtin_mul_overflow(a, b, &v); break;
+            case OP_GRE: v = a > b; break;
+            case OP_LES: v = a < b; break;
+            case OP_GEQ: v = a >= b; break;
+            case OP_LEQ: v = a <= b; break;
+            case OP_EQU: v = a == b; break;
+            case OP_NEQ: v = a != b; break;
+            }
+            if (overflow) {
+                fprintf(ERR_STREAM, "Number too big.\n");
+                free(out.entries);
+                out.entries = NULL;
+                return out;
+            }
+            out.entries[k].value = v;
+            out.entries[k].prob = x.entries[i].prob*y.entries[j].prob;
+            k++;
+        }
+    }
+    sparse_normalize(&out);
+    return out;
+}
+
+/**
+ * Distribution of x^y, where x and y are independent. Either of them can be a
+ * constant, by passing a sparse PMF with one entry. Doesn't free its inputs.
+ *
+ * \param[in] x Base
+ * \param[in] y Exponent
+ * \return Normalized sparse PMF of x^y, or one with NULL entries if some
+ * power can't be worked out or there are too many pairs of values
+ */
+SparsePMF sparse_pow(const SparsePMF x, const SparsePMF y) {
+    SparsePMF out;
+    out.entries = NULL;
+    out.len = 0;
+    // there's no FFT to fall back on here, so this is an error
+    if (y.len > 0 && x.len > SPARSE_MAX_PAIRS/y.len) {
+        fprintf(ERR_STREAM, "Too many values to raise to a power (more than %lld "
+                "pairs).\n", SPARSE_MAX_PAIRS);
+        return out;
+    }
+    out.len = x.len*y.len;
+    out.entries = malloc((out.len > 0 ? out.len : 1)*sizeof(SparseEntry));
+    if (out.entries == NULL) {
+        fprintf(ERR_STREAM, "Out of memory.\n");
+        return out;
+    }
+    int64_t k = 0;
+    int error = 0;
+    for (int64_t i = 0; i < x.len; i++) {
+        for (int64_t j = 0; j < y.len; j++) {
+            out.entries[k].value = int_pow(x.entries[i].value, y.entries[j].value,
+                                           &error);
+            if (error) {
+                free(out.entries);
+                out.entries = NULL;
+                return out;
+            }
+            out.entries[k].prob = x.entries[i].prob*y.entries[j].prob;
+            k++;
+        }
+    }
+    sparse_normalize(&out);
+    return out;
+}
+
+#endif
@@ -25,7 +25,11 @@ void get_term_size(int* rows, int* cols) {
  */
 void get_term_size(int* rows, int* cols) {
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
+        // not a terminal, let the caller pick a size
+        w.ws_row = 0;
+        w.ws_col = 0;
+    }
     *rows = w.ws_row;
     *cols = w.ws_col;
 }
@@ -0,0 +1,10 @@
+#!/bin/bash
+# runs the tests in tests/ against libdice.a, so run make.sh first
+status=0
+for t in tests/*.c; do
+    name=$(basename "$t" .c)
+    gcc -O2 -W -Wall -Wextra -Werror -std=c99 -fopenmp "$t" libdice.a \
+        -lm -lstdc++ -o "tests/$name" || { status=1; continue; }
+    "./tests/$name" || status=1
+done
+exit $status
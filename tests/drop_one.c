@@ -0,0 +1,110 @@
+// Checks dropping one die, like 20d20dl1. This used to be worked out as the
+// difference of two pools, which left rounding noise (and negative numbers)
+// in the tails, so the ends are compared against exact counts here.
+#include <stdio.h>
+#include <math.h>
+#include "../dice.h"
+
+typedef struct DropOne {
+    const char* expr;
+    int n; // dice
+    int m; // faces
+    int lowest; // true if the lowest die is dropped
+} DropOne;
+
+static int check_tail(const char* expr, const dice_pmf* pmf, const int64_t k,
+                      const double want) {
+    const double got = pmf->pmf[k];
+    if (!(fabs(got/want - 1) <= 1e-10)) {
+        printf("FAIL %s: P(%lld) = %.17g, not %.17g\n", expr,
+               (long long)(pmf->left + k*pmf->stride), got, want);
+        return 1;
+    }
+    return 0;
+}
+
+static int check(dice_ctx* ctx, const DropOne d) {
+    dice_pmf* pmf = dice_eval(ctx, d.expr);
+    if (pmf == NULL) {
+        printf("FAIL %s: couldn't evaluate\n", d.expr);
+        return 1;
+    }
+    int bad = 0;
+    if (pmf->left != d.n-1 || pmf->len != (int64_t)(d.n-1)*(d.m-1)+1
+        || pmf->stride != 1) {
+        printf("FAIL %s: wrong shape\n", d.expr);
+        dice_pmf_free(pmf);
+        return 1;
+    }
+    double total = 0;
+    for (int64_t k = 0; k < pmf->len; k++) {
+        if (pmf->pmf[k] < 0) {
+            printf("FAIL %s: P(%lld) = %g\n", d.expr,
+                   (long long)(pmf->left + k*pmf->stride), pmf->pmf[k]);
+            bad = 1;
+            break;
+        }
+        total += pmf->pmf[k];
+    }
+    if (fabs(total - 1) > 1e-12) {
+        printf("FAIL %s: adds up to %.17g\n", d.expr, total);
+        bad = 1;
+    }
+    // Dropping the lowest: the smallest sum needs every die to show 1, the
+    // next one needs one of them to show 2 (with 3 or more dice, so that a 1
+    // is dropped), and the biggest needs every die but the dropped one to
+    // show m. Dropping the highest is the mirror image.
+    const double base = pow(d.m, -d.n);
+    const double ends[3] = {base, d.n*base, (1 + (double)d.n*(d.m-1))*base};
+    const int64_t last = pmf->len-1;
+    if (d.lowest) {
+        bad |= check_tail(d.expr, pmf, 0, ends[0]);
+        bad |= d.n >= 3 && check_tail(d.expr, pmf, 1, ends[1]);
+        bad |= check_tail(d.expr, pmf, last, ends[2]);
+    } else {
+        bad |= check_tail(d.expr, pmf, last, ends[0]);
+        bad |= d.n >= 3 && check_tail(d.expr, pmf, last-1, ends[1]);
+        bad |= check_tail(d.expr, pmf, 0, ends[2]);
+    }
+    dice_pmf_free(pmf);
+    return bad;
+}
+
+int main(void) {
+    dice_init();
+    dice_ctx* ctx = dice_ctx_new();
+    const DropOne drops[] = {
+        {"20d20dl1", 20, 20, 1}, {"50d6dl1", 50, 6, 1}, {"30d100dh1", 30, 100, 0},
+        {"4d6dl1", 4, 6, 1}, {"2d6dh1", 2, 6, 0}, {"10d10kh9", 10, 10, 1}
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(drops)/sizeof(drops[0]); i++) {
+        failed |= check(ctx, drops[i]);
+    }
+    // 20d20dl1 has the same mean as drop(20, 20, 19)
+    dice_pmf* pmf = dice_eval(ctx, "20d20dl1");
+    double mean = 0;
+    for (int64_t k = 0; pmf != NULL && k < pmf->len; k++) {
+        mean += (pmf->left + k)*pmf->pmf[k];
+    }
+    if (fabs(mean - 208.465454237971) > 1e-11) {
+        printf("FAIL 20d20dl1: mean is %.15g\n", mean);
+        failed = 1;
+    }
+    dice_pmf_free(pmf);
+    // keeping 0 dice is always 0, even for 1 die
+    const char* zeros[] = {"1d6kh0", "1d6dl1", "4d6dh4"};
+    for (size_t i = 0; i < sizeof(zeros)/sizeof(zeros[0]); i++) {
+        pmf = dice_eval(ctx, zeros[i]);
+        if (pmf == NULL || pmf->len != 1 || pmf->left != 0 || pmf->pmf[0] != 1) {
+            printf("FAIL %s: isn't always 0\n", zeros[i]);
+            failed = 1;
+        }
+        dice_pmf_free(pmf);
+    }
+    dice_ctx_free(ctx);
+    if (!failed) {
+        printf("ok drop_one\n");
+    }
+    return failed;
+}
@@ -0,0 +1,51 @@
+// Checks exact mode (ntt.c) far out in the tails, where the FFT only gives
+// rounding noise.
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../dice.h"
+
+int main(void) {
+    setenv("DICE_EXACT", "1", 1);
+    dice_init();
+    dice_ctx* ctx = dice_ctx_new();
+    int failed = 0;
+    // 200d6 rolls 200 one way, 201 in 200 ways and 202 in 200*201/2 ways
+    dice_pmf* pmf = dice_eval(ctx, "200d6");
+    const double base = pow(6, -200);
+    const double want[3] = {base, 200*base, 20100*base};
+    if (pmf == NULL || pmf->left != 200 || pmf->len != 1001) {
+        printf("FAIL 200d6: wrong shape\n");
+        failed = 1;
+    } else {
+        for (int k = 0; k < 3; k++) {
+            if (fabs(pmf->pmf[k]/want[k] - 1) > 1e-13) {
+                printf("FAIL 200d6: P(%d) = %.17g, not %.17g\n", 200+k,
+                       pmf->pmf[k], want[k]);
+                failed = 1;
+            }
+            // the top end is the same by symmetry
+            if (fabs(pmf->pmf[1000-k]/want[k] - 1) > 1e-13) {
+                printf("FAIL 200d6: P(%d) = %.17g, not %.17g\n", 1200-k,
+                       pmf->pmf[1000-k], want[k]);
+                failed = 1;
+            }
+        }
+    }
+    dice_pmf_free(pmf);
+    // sums go through recover_counts, then the NTT
+    pmf = dice_eval(ctx, "20d6+20d6");
+    const double low = pow(6, -40);
+    if (pmf == NULL || pmf->left != 40 || fabs(pmf->pmf[0]/low - 1) > 1e-13
+            || fabs(pmf->pmf[1]/(40*low) - 1) > 1e-13) {
+        printf("FAIL 20d6+20d6: wrong tail\n");
+        failed = 1;
+    }
+    dice_pmf_free(pmf);
+    dice_ctx_free(ctx);
+    if (!failed) {
+        printf("ok exact\n");
+    }
+    return failed;
+}
@@ -0,0 +1,62 @@
+// Checks that spread out results like 1d100^4 stay sparse instead of being
+// made into huge mostly-zero arrays (see sparse.c).
+#include <stdio.h>
+#include <math.h>
+#include "../dice.h"
+
+static int check(dice_ctx* ctx, const char* expr, const int64_t len,
+                 const double mean) {
+    dice_pmf* pmf = dice_eval(ctx, expr);
+    if (pmf == NULL) {
+        printf("FAIL %s: couldn't evaluate\n", expr);
+        return 1;
+    }
+    int bad = 0;
+    if (pmf->values == NULL || pmf->stride != 0 || pmf->len != len) {
+        printf("FAIL %s: expected %lld sparse values, got len %lld stride %lld\n",
+               expr, (long long)len, (long long)pmf->len, (long long)pmf->stride);
+        bad = 1;
+    } else {
+        double total = 0;
+        double mu = 0;
+        for (int64_t k = 0; k < pmf->len; k++) {
+            total += pmf->pmf[k];
+            mu += pmf->pmf[k]*pmf->values[k];
+            if (k > 0 && pmf->values[k] <= pmf->values[k-1]) {
+                printf("FAIL %s: values out of order\n", expr);
+                bad = 1;
+                break;
+            }
+        }
+        if (fabs(total - 1) > 1e-12 || fabs(mu - mean) > 1e-9*mean) {
+            printf("FAIL %s: total %.17g, mean %.17g\n", expr, total, mu);
+            bad = 1;
+        }
+    }
+    dice_pmf_free(pmf);
+    return bad;
+}
+
+int main(void) {
+    dice_init();
+    dice_ctx* ctx = dice_ctx_new();
+    int failed = 0;
+    failed |= check(ctx, "1d6^3", 6, 73.5);
+    // 1^k is always 1, and 2^4 = 4^2, 2^6 = 4^3 = 8^2, etc.
+    failed |= check(ctx, "1d6^1d6", 28, 2283.3333333333333);
+    // way too spread out to ever be dense
+    failed |= check(ctx, "1d100^4", 100, 20503333.3);
+    failed |= check(ctx, "1d100^4+1d6^3", 600, 20503333.3 + 73.5);
+    // too many pairs of values, should fail instead of allocating them
+    dice_pmf* pmf = dice_eval(ctx, "1000d1000^1d20");
+    if (pmf != NULL) {
+        printf("FAIL 1000d1000^1d20: should be too big\n");
+        dice_pmf_free(pmf);
+        failed = 1;
+    }
+    dice_ctx_free(ctx);
+    if (!failed) {
+        printf("ok sparse\n");
+    }
+    return failed;
+}